@@ -0,0 +1,124 @@
+/****
+ * Compares the fast paths of vfb2_convert with the scalar reference
+ *
+ * Every fast path is first checked against the scalar output on random
+ * contents, then both are timed on a full frame.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "vfb2_convert.h"
+
+#define XRES	1920
+#define YRES	1080
+
+static const char *wire_names[] = { "rgb565be", "bgr888", "mono1" };
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(struct vfb2_convert *cv, const uint8_t *fb,
+		  uint32_t line_length, struct vfb2_rect *r, uint8_t *dst,
+		  size_t pitch)
+{
+	double start, t;
+	int i, loops = 0;
+
+	start = now();
+	do {
+		for (i=0; i<10; i++)
+			vfb2_convert_rect(cv, fb, line_length, r, dst, pitch);
+		loops += 10;
+		t = now() - start;
+	} while (t < 0.5);
+
+	/* Mpixel/s */
+	return (double)r->width * r->height * loops / t / 1e6;
+}
+
+static int bench(uint32_t bpp, uint32_t wire, uint8_t *fb, uint32_t *palette)
+{
+	struct vfb2_mode mode = { XRES, YRES, bpp, 0, VFB2_16BPP_NO_TRANSP };
+	struct vfb2_convert scalar, fast;
+	uint32_t line_length = XRES * (bpp >> 3);
+	/* odd sizes catch errors in the tails */
+	struct vfb2_rect check = { 3, 5, 251, 17 };
+	struct vfb2_rect full = { 0, 0, XRES, YRES };
+	uint8_t *ref, *out;
+	size_t pitch;
+	double s, f;
+	int ret = 0;
+
+	if (vfb2_convert_init(&scalar, &mode, wire, palette,
+			      VFB2_CONVERT_SCALAR) ||
+	    vfb2_convert_init(&fast, &mode, wire, palette, 0)) {
+		fprintf(stderr, "%ubpp -> %s not supported\n", bpp,
+			wire_names[wire]);
+		return 1;
+	}
+
+	pitch = vfb2_convert_pitch(&scalar, XRES);
+	ref = calloc(YRES, pitch);
+	out = calloc(YRES, pitch);
+	if (!ref || !out) {
+		ret = 1;
+		goto exit;
+	}
+
+	vfb2_convert_rect(&scalar, fb, line_length, &check, ref, pitch);
+	vfb2_convert_rect(&fast, fb, line_length, &check, out, pitch);
+	if (memcmp(ref, out, pitch * check.height)) {
+		fprintf(stderr, "%ubpp -> %s: %s differs from scalar\n", bpp,
+			wire_names[wire], fast.row_name);
+		ret = 1;
+		goto exit;
+	}
+
+	s = run(&scalar, fb, line_length, &full, ref, pitch);
+	f = run(&fast, fb, line_length, &full, out, pitch);
+	printf("%2ubpp -> %-8s  scalar %8.1f Mpix/s  %-6s %8.1f Mpix/s  "
+	       "x%.1f\n", bpp, wire_names[wire], s, fast.row_name, f, f / s);
+exit:
+	free(ref);
+	free(out);
+	return ret;
+}
+
+int main(void)
+{
+	uint32_t palette[256];
+	uint8_t *fb;
+	size_t i, size = (size_t)XRES * YRES * 4;
+	int ret = 0;
+
+	fb = malloc(size);
+	if (!fb)
+		return 1;
+	srand(1);
+	for (i=0; i<size; i++)
+		fb[i] = rand();
+	for (i=0; i<256; i++)
+		palette[i] = rand() & 0xffffff;
+
+	ret |= bench(32, VFB2_WIRE_RGB565_BE, fb, palette);
+	ret |= bench(32, VFB2_WIRE_BGR888, fb, palette);
+	ret |= bench(8, VFB2_WIRE_RGB565_BE, fb, palette);
+	ret |= bench(8, VFB2_WIRE_BGR888, fb, palette);
+	ret |= bench(16, VFB2_WIRE_BGR888, fb, palette);
+	ret |= bench(32, VFB2_WIRE_MONO1, fb, palette);
+
+	free(fb);
+	return ret;
+}
@@ -0,0 +1,331 @@
+/****
+ * Conversion of vfb2 frame buffer contents to panel wire formats
+ *
+ * The frame buffer layout is the one set by vfb2_set_bitfields: red in the
+ * lowest bits, so 24 and 32bpp pixels are red, green, blue bytes in memory.
+ * The scalar rows are the reference, the fast paths have to produce the
+ * same bytes.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <string.h>
+#include "vfb2_convert.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define VFB2_HAVE_SSE2
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <tmmintrin.h>
+#define VFB2_HAVE_SSSE3
+#endif
+
+/* returns 0x00BBGGRR */
+static inline uint32_t vfb2_read_pixel(const struct vfb2_convert *cv,
+				       const uint8_t *p)
+{
+	uint32_t v, r, g, b;
+
+	switch (cv->bpp) {
+	case 8:
+		return cv->palette[*p];
+	case 16:
+		v = p[0] | (p[1] << 8);
+		r = v & 0x1f;
+		if (cv->transp_mode == VFB2_16BPP_TRANSP) {
+			g = (v >> 5) & 0x1f;
+			b = (v >> 10) & 0x1f;
+			g = (g << 3) | (g >> 2);
+		} else {
+			g = (v >> 5) & 0x3f;
+			b = (v >> 11) & 0x1f;
+			g = (g << 2) | (g >> 4);
+		}
+		r = (r << 3) | (r >> 2);
+		b = (b << 3) | (b >> 2);
+		return r | (g << 8) | (b << 16);
+	}
+	/* 24 and 32 */
+	return p[0] | (p[1] << 8) | (p[2] << 16);
+}
+
+static inline uint32_t vfb2_rgb565(uint32_t rgb)
+{
+	return ((rgb & 0xf8) << 8) | ((rgb & 0xfc00) >> 5) |
+	       ((rgb & 0xf80000) >> 19);
+}
+
+static inline uint32_t vfb2_luma(uint32_t rgb)
+{
+	return ((rgb & 0xff) * 77 + ((rgb >> 8) & 0xff) * 150 +
+		((rgb >> 16) & 0xff) * 29) >> 8;
+}
+
+static void vfb2_row_rgb565_be(const struct vfb2_convert *cv,
+			       const uint8_t *src, uint8_t *dst, uint32_t n)
+{
+	uint32_t i, v, step = cv->bpp >> 3;
+
+	for (i=0; i<n; i++, src += step) {
+		v = vfb2_rgb565(vfb2_read_pixel(cv, src));
+		*dst++ = v >> 8;
+		*dst++ = v;
+	}
+}
+
+static void vfb2_row_bgr888(const struct vfb2_convert *cv,
+			    const uint8_t *src, uint8_t *dst, uint32_t n)
+{
+	uint32_t i, v, step = cv->bpp >> 3;
+
+	for (i=0; i<n; i++, src += step) {
+		v = vfb2_read_pixel(cv, src);
+		*dst++ = v >> 16;
+		*dst++ = v >> 8;
+		*dst++ = v;
+	}
+}
+
+static void vfb2_row_mono1(const struct vfb2_convert *cv,
+			   const uint8_t *src, uint8_t *dst, uint32_t n)
+{
+	uint32_t i, step = cv->bpp >> 3;
+	uint8_t bits = 0;
+
+	for (i=0; i<n; i++, src += step) {
+		bits = (bits << 1) | (vfb2_luma(vfb2_read_pixel(cv, src)) >> 7);
+		if ((i & 7) == 7) {
+			*dst++ = bits;
+			bits = 0;
+		}
+	}
+	if (n & 7)
+		*dst = bits << (8 - (n & 7));
+}
+
+/* 8bpp: one table lookup per pixel, the palette is converted only once */
+static void vfb2_row_lut16(const struct vfb2_convert *cv,
+			   const uint8_t *src, uint8_t *dst, uint32_t n)
+{
+	const uint32_t *lut = cv->lut;
+	uint32_t i, v;
+
+	for (i=0; i+4<=n; i+=4, src+=4, dst+=8) {
+		v = lut[src[0]];
+		dst[0] = v >> 8;
+		dst[1] = v;
+		v = lut[src[1]];
+		dst[2] = v >> 8;
+		dst[3] = v;
+		v = lut[src[2]];
+		dst[4] = v >> 8;
+		dst[5] = v;
+		v = lut[src[3]];
+		dst[6] = v >> 8;
+		dst[7] = v;
+	}
+	for (; i<n; i++, src++, dst+=2) {
+		v = lut[*src];
+		dst[0] = v >> 8;
+		dst[1] = v;
+	}
+}
+
+static void vfb2_row_lut24(const struct vfb2_convert *cv,
+			   const uint8_t *src, uint8_t *dst, uint32_t n)
+{
+	const uint32_t *lut = cv->lut;
+	uint32_t i, v;
+
+	/* the lut holds the wire bytes in memory order, the fourth byte
+	 * is overwritten by the next pixel */
+	for (i=0; i+1<n; i++, src++, dst+=3) {
+		v = lut[*src];
+		memcpy(dst, &v, 4);
+	}
+	if (i < n) {
+		v = lut[*src];
+		memcpy(dst, &v, 3);
+	}
+}
+
+#ifdef VFB2_HAVE_SSE2
+static void vfb2_row_rgb565_be_sse2(const struct vfb2_convert *cv,
+				    const uint8_t *src, uint8_t *dst,
+				    uint32_t n)
+{
+	const __m128i mask_r = _mm_set1_epi32(0xf8);
+	const __m128i mask_g = _mm_set1_epi32(0xfc00);
+	const __m128i mask_b = _mm_set1_epi32(0xf80000);
+	__m128i a, b, va, vb;
+	uint32_t i = 0;
+
+#define VFB2_RGB565_BE(x, v)						\
+	do {								\
+		v = _mm_or_si128(_mm_or_si128(				\
+			_mm_slli_epi32(_mm_and_si128(x, mask_r), 8),	\
+			_mm_srli_epi32(_mm_and_si128(x, mask_g), 5)),	\
+			_mm_srli_epi32(_mm_and_si128(x, mask_b), 19));	\
+		/* swap the bytes and sign extend for packs */		\
+		v = _mm_or_si128(_mm_slli_epi32(v, 24),			\
+				 _mm_slli_epi32(_mm_srli_epi32(v, 8), 16)); \
+		v = _mm_srai_epi32(v, 16);				\
+	} while (0)
+
+	for (; i+8<=n; i+=8, src+=32, dst+=16) {
+		a = _mm_loadu_si128((const __m128i *)src);
+		b = _mm_loadu_si128((const __m128i *)(src + 16));
+		VFB2_RGB565_BE(a, va);
+		VFB2_RGB565_BE(b, vb);
+		_mm_storeu_si128((__m128i *)dst, _mm_packs_epi32(va, vb));
+	}
+#undef VFB2_RGB565_BE
+
+	vfb2_row_rgb565_be(cv, src, dst, n - i);
+}
+#endif
+
+#ifdef VFB2_HAVE_SSSE3
+__attribute__((target("ssse3")))
+static void vfb2_row_bgr888_ssse3(const struct vfb2_convert *cv,
+				  const uint8_t *src, uint8_t *dst,
+				  uint32_t n)
+{
+	const __m128i shuf = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+					   14, 13, 12, -1, -1, -1, -1);
+	__m128i v;
+	uint32_t i = 0;
+
+	/* each store writes 16 bytes for 12, stop early enough that the
+	 * rest lies inside the row */
+	for (; i+6<=n; i+=4, src+=16, dst+=12) {
+		v = _mm_loadu_si128((const __m128i *)src);
+		_mm_storeu_si128((__m128i *)dst, _mm_shuffle_epi8(v, shuf));
+	}
+
+	vfb2_row_bgr888(cv, src, dst, n - i);
+}
+#endif
+
+static uint32_t vfb2_wire_pixel(uint32_t wire, uint32_t rgb)
+{
+	uint8_t b[4] = { 0 };
+	uint32_t v;
+
+	switch (wire) {
+	case VFB2_WIRE_RGB565_BE:
+		return vfb2_rgb565(rgb);
+	case VFB2_WIRE_BGR888:
+		b[0] = rgb >> 16;
+		b[1] = rgb >> 8;
+		b[2] = rgb;
+		memcpy(&v, b, 4);
+		return v;
+	}
+	return vfb2_luma(rgb) >> 7;
+}
+
+void vfb2_convert_set_palette(struct vfb2_convert *cv,
+			      const uint32_t *palette)
+{
+	int i;
+
+	if (palette)
+		memcpy(cv->palette, palette, sizeof(cv->palette));
+	for (i=0; i<256; i++)
+		cv->lut[i] = vfb2_wire_pixel(cv->wire, cv->palette[i]);
+}
+
+int vfb2_convert_init(struct vfb2_convert *cv, const struct vfb2_mode *mode,
+		      uint32_t wire, const uint32_t *palette, uint32_t flags)
+{
+	int fast = !(flags & VFB2_CONVERT_SCALAR);
+
+	memset(cv, 0x00, sizeof(struct vfb2_convert));
+	switch (mode->bpp) {
+	case 8:
+	case 16:
+	case 24:
+	case 32:
+		break;
+	default:
+		return -1;
+	}
+	cv->bpp = mode->bpp;
+	cv->transp_mode = mode->transp_mode;
+	cv->wire = wire;
+	vfb2_convert_set_palette(cv, palette);
+
+	switch (wire) {
+	case VFB2_WIRE_RGB565_BE:
+		cv->row = vfb2_row_rgb565_be;
+		cv->row_name = "scalar";
+		break;
+	case VFB2_WIRE_BGR888:
+		cv->row = vfb2_row_bgr888;
+		cv->row_name = "scalar";
+		break;
+	case VFB2_WIRE_MONO1:
+		cv->row = vfb2_row_mono1;
+		cv->row_name = "scalar";
+		return 0;
+	default:
+		return -1;
+	}
+
+	if (!fast)
+		return 0;
+
+	if (cv->bpp == 8) {
+		cv->row = (wire == VFB2_WIRE_RGB565_BE) ? vfb2_row_lut16 :
+							  vfb2_row_lut24;
+		cv->row_name = "lut";
+	}
+#ifdef VFB2_HAVE_SSE2
+	if ((cv->bpp == 32) && (wire == VFB2_WIRE_RGB565_BE)) {
+		cv->row = vfb2_row_rgb565_be_sse2;
+		cv->row_name = "sse2";
+	}
+#endif
+#ifdef VFB2_HAVE_SSSE3
+	if ((cv->bpp == 32) && (wire == VFB2_WIRE_BGR888) &&
+	    __builtin_cpu_supports("ssse3")) {
+		cv->row = vfb2_row_bgr888_ssse3;
+		cv->row_name = "ssse3";
+	}
+#endif
+	return 0;
+}
+
+size_t vfb2_convert_pitch(const struct vfb2_convert *cv, uint32_t width)
+{
+	switch (cv->wire) {
+	case VFB2_WIRE_RGB565_BE:
+		return (size_t)width * 2;
+	case VFB2_WIRE_BGR888:
+		return (size_t)width * 3;
+	}
+	return (width + 7) / 8;
+}
+
+void vfb2_convert_rect(const struct vfb2_convert *cv, const void *fb,
+		       uint32_t line_length, const struct vfb2_rect *r,
+		       void *dst, size_t dst_pitch)
+{
+	const uint8_t *src = (const uint8_t *)fb +
+			     (size_t)r->y * line_length +
+			     (size_t)r->x * (cv->bpp >> 3);
+	uint8_t *out = dst;
+	uint32_t line;
+
+	for (line=0; line<r->height; line++) {
+		cv->row(cv, src, out, r->width);
+		src += line_length;
+		out += dst_pitch;
+	}
+}
@@ -0,0 +1,64 @@
+/****
+ * Conversion of vfb2 frame buffer contents to panel wire formats
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#ifndef _VFB2_CONVERT_H
+#define _VFB2_CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "vfb2.h"
+
+/* formats the panels want on the wire */
+#define VFB2_WIRE_RGB565_BE	0	/* red in the top bits, big endian */
+#define VFB2_WIRE_BGR888	1	/* blue, green, red bytes */
+#define VFB2_WIRE_MONO1		2	/* 1 bit per pixel, msb first, rows
+					 * padded to a byte */
+
+/* flags for vfb2_convert_init */
+#define VFB2_CONVERT_SCALAR	0x00000001	/* no vectorized fast paths */
+
+struct vfb2_convert;
+
+typedef void (*vfb2_convert_row_t)(const struct vfb2_convert *cv,
+				   const uint8_t *src, uint8_t *dst,
+				   uint32_t n);
+
+struct vfb2_convert {
+	uint32_t bpp;
+	uint32_t transp_mode;
+	uint32_t wire;
+	/* 8bpp: the colour map as 0x00BBGGRR, like a 32bpp pixel */
+	uint32_t palette[256];
+	/* 8bpp: the palette in the wire format */
+	uint32_t lut[256];
+	vfb2_convert_row_t row;
+	const char *row_name;
+};
+
+/* for 8, 16, 24 and 32bpp modes, palette may be NULL for modes with more
+ * than 8bpp, returns -1 if the conversion is not supported */
+extern int vfb2_convert_init(struct vfb2_convert *cv,
+			     const struct vfb2_mode *mode, uint32_t wire,
+			     const uint32_t *palette, uint32_t flags);
+
+/* recalculates the lookup table after the colour map changed */
+extern void vfb2_convert_set_palette(struct vfb2_convert *cv,
+				     const uint32_t *palette);
+
+/* bytes of one converted row of width pixels */
+extern size_t vfb2_convert_pitch(const struct vfb2_convert *cv,
+				 uint32_t width);
+
+/* converts the rectangle r of the frame buffer fb into dst, which is
+ * dst_pitch bytes per row and starts with the top left pixel of r */
+extern void vfb2_convert_rect(const struct vfb2_convert *cv, const void *fb,
+			      uint32_t line_length, const struct vfb2_rect *r,
+			      void *dst, size_t dst_pitch);
+
+#endif /* _VFB2_CONVERT_H */
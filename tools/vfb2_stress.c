@@ -0,0 +1,461 @@
+/****
+ * Load generator and benchmark for vfb2 and vfb2_user
+ *
+ * Creates a number of user space fbs with UVFB2_CREATE, each with three
+ * threads:
+ *   writer:   writes a moving band of lines through an mmap of /dev/fbN
+ *   drawer:   fbcon style load through write(): glyph blits, filled text
+ *             rows and a scroll (copy) whenever the bottom is reached
+ *   consumer: waits for events and harvests dirty pages and damage, like
+ *             a display driver in user space
+ * and reports frame latency (first write to harvest), update throughput,
+ * syscalls per harvest and, if the kernel has CONFIG_LOCK_STAT, the
+ * contention on the vfb2 locks.
+ *
+ * usage: vfb2_stress [-n fbs] [-t seconds] [-x xres] [-y yres] [-b lines]
+ *                    [-f fps] [-c] [-d]
+ *   -b: lines per band written by the writer (default 64)
+ *   -f: frames per second of the writer, 0 runs as fast as possible
+ *   -c: VFB2_FLAG_CONTIG
+ *   -d: no drawer
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "vfb2_user.h"
+
+#define STRESS_MAX_FBS		32
+#define STRESS_CELL_WIDTH	8
+#define STRESS_CELL_HEIGHT	16
+/* dirty pages per UVFB2_DIRTY_PAGES call */
+#define STRESS_PAGES		1024
+
+struct stress_fb {
+	int ufd;
+	int fd;
+	int node;
+	uint8_t *fb;
+	size_t size;
+	uint32_t line_length;
+	pthread_t writer;
+	pthread_t drawer;
+	pthread_t consumer;
+	/* ns of the first write that was not harvested yet, 0 if none */
+	uint64_t pending;
+	/* writer */
+	uint64_t frames;
+	/* drawer */
+	uint64_t draw_ops;
+	uint64_t draw_calls;
+	/* consumer */
+	uint64_t harvests;
+	uint64_t harvested_bytes;
+	uint64_t calls;
+	double *latency;
+	size_t num_latency;
+	size_t max_latency;
+};
+
+static struct stress_fb fbs[STRESS_MAX_FBS];
+static volatile int stop;
+static uint32_t xres = 1920, yres = 1080, band = 64, fps;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* called before touching the frame buffer */
+static inline void stress_mark(struct stress_fb *s)
+{
+	if (!s->pending)
+		__sync_bool_compare_and_swap(&s->pending, 0, now_ns());
+}
+
+static void *stress_writer(void *arg)
+{
+	struct stress_fb *s = arg;
+	uint64_t next = now_ns();
+	uint32_t y = 0, lines;
+
+	while (!stop) {
+		lines = (y + band > yres) ? yres - y : band;
+		stress_mark(s);
+		memset(s->fb + (size_t)y * s->line_length, s->frames,
+		       (size_t)lines * s->line_length);
+		y = (y + lines) % yres;
+		s->frames++;
+
+		if (fps) {
+			next += 1000000000ULL / fps;
+			while (!stop && (now_ns() < next))
+				usleep(100);
+		}
+	}
+	return NULL;
+}
+
+static void *stress_drawer(void *arg)
+{
+	struct stress_fb *s = arg;
+	uint32_t cols = xres / STRESS_CELL_WIDTH;
+	uint32_t rows = yres / STRESS_CELL_HEIGHT;
+	size_t row_bytes = (size_t)STRESS_CELL_HEIGHT * s->line_length;
+	size_t screen = (size_t)rows * row_bytes;
+	uint8_t glyph[STRESS_CELL_WIDTH * 4], *buf;
+	uint32_t col = 0, row = 0, line;
+	off_t pos;
+
+	buf = malloc(screen);
+	if (!buf)
+		return NULL;
+	memset(glyph, 0xaa, sizeof(glyph));
+
+	while (!stop) {
+		stress_mark(s);
+		/* imageblit: one write per glyph line */
+		pos = (off_t)row * row_bytes + col * sizeof(glyph);
+		for (line=0; line<STRESS_CELL_HEIGHT; line++) {
+			if (pwrite(s->fd, glyph, sizeof(glyph),
+				   pos + (off_t)line * s->line_length) < 0)
+				goto exit;
+			s->draw_calls++;
+		}
+		s->draw_ops++;
+		if (++col < cols)
+			continue;
+
+		/* end of the line, fillrect the next text row */
+		col = 0;
+		if (++row == rows) {
+			/* copyarea: scroll up by one text row */
+			if (pread(s->fd, buf, screen - row_bytes,
+				  row_bytes) < 0 ||
+			    pwrite(s->fd, buf, screen - row_bytes, 0) < 0)
+				goto exit;
+			s->draw_calls += 2;
+			s->draw_ops++;
+			row = rows - 1;
+		}
+		memset(buf, 0x00, row_bytes);
+		if (pwrite(s->fd, buf, row_bytes, (off_t)row * row_bytes) < 0)
+			goto exit;
+		s->draw_calls++;
+		s->draw_ops++;
+	}
+exit:
+	free(buf);
+	return NULL;
+}
+
+static void stress_latency(struct stress_fb *s, double ms)
+{
+	double *l;
+
+	if (s->num_latency == s->max_latency) {
+		s->max_latency = s->max_latency ? s->max_latency * 2 : 4096;
+		l = realloc(s->latency, s->max_latency * sizeof(double));
+		if (!l) {
+			s->max_latency = s->num_latency;
+			return;
+		}
+		s->latency = l;
+	}
+	s->latency[s->num_latency++] = ms;
+}
+
+static void *stress_consumer(void *arg)
+{
+	struct stress_fb *s = arg;
+	struct vfb2_dirty_pages dirty;
+	struct vfb2_damage damage;
+	__u32 pages[STRESS_PAGES];
+	__u32 events, i;
+	uint64_t bytes, start;
+
+	while (!stop) {
+		events = 100;
+		s->calls++;
+		if (ioctl(s->ufd, UVFB2_WAIT, &events))
+			break;
+		bytes = 0;
+
+		if (events & VFB2_EVENT_DIRTY)
+			do {
+				dirty.count = STRESS_PAGES;
+				dirty.pages = (uintptr_t)pages;
+				s->calls++;
+				if (ioctl(s->ufd, UVFB2_DIRTY_PAGES, &dirty))
+					goto exit;
+				bytes += (uint64_t)dirty.count * 4096;
+			} while (dirty.count == STRESS_PAGES);
+
+		if (events & VFB2_EVENT_DAMAGE) {
+			s->calls++;
+			if (ioctl(s->ufd, UVFB2_DAMAGE, &damage))
+				break;
+			for (i=0; i<damage.count; i++)
+				bytes += (uint64_t)damage.rect[i].width *
+					 damage.rect[i].height * 4;
+		}
+
+		if (!bytes)
+			continue;
+		start = __sync_lock_test_and_set(&s->pending, 0);
+		if (start)
+			stress_latency(s, (now_ns() - start) / 1e6);
+		s->harvests++;
+		s->harvested_bytes += bytes;
+	}
+exit:
+	return NULL;
+}
+
+static int stress_create(struct stress_fb *s, uint32_t flags)
+{
+	struct vfb2_mode mode = { xres, yres, 32, 0, VFB2_16BPP_NO_TRANSP };
+	struct uvfb2_create create;
+	char path[32];
+
+	s->line_length = xres * 4;
+	s->size = (size_t)s->line_length * yres;
+	s->fd = -1;
+	s->ufd = open("/proc/" UVFB2_DEVICE, O_RDWR);
+	if (s->ufd < 0) {
+		perror("/proc/" UVFB2_DEVICE);
+		return -1;
+	}
+
+	memset(&create, 0x00, sizeof(create));
+	create.size = sizeof(create);
+	create.flags = VFB2_FLAG_DAMAGE | VFB2_FLAG_DEFIO | flags;
+	create.vmem_len = s->size;
+	create.num_modes = 1;
+	create.modes = (uintptr_t)&mode;
+	if (ioctl(s->ufd, UVFB2_CREATE, &create)) {
+		perror("UVFB2_CREATE");
+		return -1;
+	}
+	s->node = create.node;
+
+	snprintf(path, sizeof(path), "/dev/fb%d", s->node);
+	s->fd = open(path, O_RDWR);
+	if (s->fd < 0) {
+		perror(path);
+		return -1;
+	}
+	s->fb = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		     s->fd, 0);
+	if (s->fb == MAP_FAILED) {
+		s->fb = NULL;
+		perror("mmap");
+		return -1;
+	}
+	return 0;
+}
+
+static void stress_destroy(struct stress_fb *s)
+{
+	if (s->fb)
+		munmap(s->fb, s->size);
+	if (s->fd >= 0)
+		close(s->fd);
+	/* unregisters the fb */
+	if (s->ufd >= 0)
+		close(s->ufd);
+	free(s->latency);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile(const double *l, size_t n, int p)
+{
+	if (!n)
+		return 0;
+	return l[(n - 1) * p / 100];
+}
+
+/* the lock_stat lines of the vfb2 locks */
+static void print_lock_stat(void)
+{
+	static const char *locks[] = {
+		"damage_lock", "dirty_lock", "event_lock", "client_lock",
+		"vmem_lock", "vmem_mutex", "ioctl_sem", NULL
+	};
+	char line[512];
+	FILE *f;
+	int i, header = 0;
+
+	f = fopen("/proc/lock_stat", "r");
+	if (!f) {
+		printf("lock contention: /proc/lock_stat not available "
+		       "(CONFIG_LOCK_STAT)\n");
+		return;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (!header && strstr(line, "class name")) {
+			fputs(line, stdout);
+			header = 1;
+		}
+		/* the class lines end with a colon */
+		if (!strchr(line, ':') || strstr(line, "-> ["))
+			continue;
+		for (i=0; locks[i]; i++)
+			if (strstr(line, locks[i])) {
+				fputs(line, stdout);
+				break;
+			}
+	}
+	fclose(f);
+}
+
+static void report(int n, double seconds)
+{
+	uint64_t frames = 0, ops = 0, draw_calls = 0, harvests = 0;
+	uint64_t bytes = 0, calls = 0;
+	size_t num = 0, i, j;
+	double *all;
+	int k;
+
+	printf("fb    frames/s   draw ops/s  harvests/s      MB/s  "
+	       "calls/harvest  p50 ms  p99 ms  max ms\n");
+	for (k=0; k<n; k++) {
+		struct stress_fb *s = &fbs[k];
+
+		qsort(s->latency, s->num_latency, sizeof(double), cmp_double);
+		printf("fb%-3d %9.0f  %11.0f  %10.0f  %8.1f  %13.2f  %6.2f  "
+		       "%6.2f  %6.2f\n", s->node, s->frames / seconds,
+		       s->draw_ops / seconds, s->harvests / seconds,
+		       s->harvested_bytes / seconds / 1e6,
+		       s->harvests ? (double)s->calls / s->harvests : 0,
+		       percentile(s->latency, s->num_latency, 50),
+		       percentile(s->latency, s->num_latency, 99),
+		       s->num_latency ? s->latency[s->num_latency - 1] : 0);
+		frames += s->frames;
+		ops += s->draw_ops;
+		draw_calls += s->draw_calls;
+		harvests += s->harvests;
+		bytes += s->harvested_bytes;
+		calls += s->calls;
+		num += s->num_latency;
+	}
+
+	all = malloc((num ? num : 1) * sizeof(double));
+	if (!all)
+		return;
+	for (k=0, j=0; k<n; k++)
+		for (i=0; i<fbs[k].num_latency; i++)
+			all[j++] = fbs[k].latency[i];
+	qsort(all, num, sizeof(double), cmp_double);
+	printf("all   %9.0f  %11.0f  %10.0f  %8.1f  %13.2f  %6.2f  %6.2f  "
+	       "%6.2f\n", frames / seconds, ops / seconds, harvests / seconds,
+	       bytes / seconds / 1e6, harvests ? (double)calls / harvests : 0,
+	       percentile(all, num, 50), percentile(all, num, 99),
+	       num ? all[num - 1] : 0);
+	printf("drawer: %.2f write calls per drawing operation\n",
+	       ops ? (double)draw_calls / ops : 0);
+	free(all);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t flags = 0;
+	int n = 4, seconds = 10, draw = 1, opt, i, ret = 1;
+
+	while ((opt = getopt(argc, argv, "n:t:x:y:b:f:cd")) != -1) {
+		switch (opt) {
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'x':
+			xres = strtoul(optarg, NULL, 0);
+			break;
+		case 'y':
+			yres = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			band = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			fps = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			flags |= VFB2_FLAG_CONTIG;
+			break;
+		case 'd':
+			draw = 0;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n fbs] [-t seconds] "
+				"[-x xres] [-y yres] [-b lines] [-f fps] "
+				"[-c] [-d]\n", argv[0]);
+			return 1;
+		}
+	}
+	if ((n < 1) || (n > STRESS_MAX_FBS) || (seconds < 1) ||
+	    (xres < STRESS_CELL_WIDTH) || (yres < 2 * STRESS_CELL_HEIGHT) ||
+	    !band) {
+		fprintf(stderr, "invalid arguments\n");
+		return 1;
+	}
+
+	for (i=0; i<n; i++) {
+		fbs[i].ufd = -1;
+		fbs[i].fd = -1;
+	}
+	for (i=0; i<n; i++)
+		if (stress_create(&fbs[i], flags))
+			goto exit;
+
+	for (i=0; i<n; i++) {
+		pthread_create(&fbs[i].consumer, NULL, stress_consumer,
+			       &fbs[i]);
+		pthread_create(&fbs[i].writer, NULL, stress_writer, &fbs[i]);
+		if (draw)
+			pthread_create(&fbs[i].drawer, NULL, stress_drawer,
+				       &fbs[i]);
+	}
+	sleep(seconds);
+	stop = 1;
+	for (i=0; i<n; i++) {
+		pthread_join(fbs[i].writer, NULL);
+		if (draw)
+			pthread_join(fbs[i].drawer, NULL);
+		pthread_join(fbs[i].consumer, NULL);
+	}
+
+	printf("%d fbs %ux%u-32, %d s, band %u lines, %s\n", n, xres, yres,
+	       seconds, band, (flags & VFB2_FLAG_CONTIG) ? "contig" :
+							   "vmalloc");
+	report(n, seconds);
+	print_lock_stat();
+	ret = 0;
+exit:
+	for (i=0; i<n; i++)
+		stress_destroy(&fbs[i]);
+	return ret;
+}
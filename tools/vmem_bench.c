@@ -0,0 +1,140 @@
+/****
+ * Full frame read and write bandwidth of mmapped vfb2 video memory
+ *
+ * Creates a user space fb through /proc/driver/userfb once with vmalloc
+ * memory and once with VFB2_FLAG_CONTIG, maps /dev/fbN and times writing
+ * and reading whole frames. Needs vfb2 and vfb2_user loaded.
+ *
+ * usage: vmem_bench [xres yres]	(default 3840 2160, 32bpp)
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "vfb2_user.h"
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the sum keeps the compiler from dropping the reads */
+static uint64_t read_frame(const volatile uint64_t *p, size_t n)
+{
+	uint64_t sum = 0;
+	size_t i;
+
+	for (i=0; i<n; i++)
+		sum += p[i];
+	return sum;
+}
+
+/* GB/s, at least half a second of frames */
+static double run(void *fb, size_t size, int write, uint64_t *sum)
+{
+	double start, t;
+	int frames = 0;
+
+	start = now();
+	do {
+		if (write)
+			memset(fb, frames, size);
+		else
+			*sum += read_frame(fb, size / sizeof(uint64_t));
+		frames++;
+		t = now() - start;
+	} while (t < 0.5);
+
+	return (double)size * frames / t / 1e9;
+}
+
+static int bench(const char *name, uint32_t flags, uint32_t xres,
+		 uint32_t yres)
+{
+	struct vfb2_mode mode = { xres, yres, 32, 0, VFB2_16BPP_NO_TRANSP };
+	struct uvfb2_create create;
+	size_t size = (size_t)xres * yres * 4;
+	uint64_t sum = 0;
+	char path[32];
+	double w, r, first;
+	void *fb;
+	int ufd, fd = -1, ret = 1;
+
+	ufd = open("/proc/" UVFB2_DEVICE, O_RDWR);
+	if (ufd < 0) {
+		perror("/proc/" UVFB2_DEVICE);
+		return 1;
+	}
+
+	memset(&create, 0x00, sizeof(create));
+	create.size = sizeof(create);
+	create.flags = flags;
+	create.vmem_len = size;
+	create.num_modes = 1;
+	create.modes = (uintptr_t)&mode;
+	if (ioctl(ufd, UVFB2_CREATE, &create)) {
+		perror("UVFB2_CREATE");
+		goto exit;
+	}
+
+	snprintf(path, sizeof(path), "/dev/fb%d", create.node);
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		perror(path);
+		goto exit;
+	}
+	fb = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (fb == MAP_FAILED) {
+		perror("mmap");
+		goto exit;
+	}
+
+	/* the first frame includes setting up the page tables */
+	first = now();
+	memset(fb, 0xff, size);
+	first = now() - first;
+	w = run(fb, size, 1, &sum);
+	r = run(fb, size, 0, &sum);
+	printf("%-8s %ux%u  first write %7.2f ms  write %6.2f GB/s  "
+	       "read %6.2f GB/s\n", name, xres, yres, first * 1e3, w, r);
+	munmap(fb, size);
+	ret = 0;
+exit:
+	if (fd >= 0)
+		close(fd);
+	/* unregisters the fb */
+	close(ufd);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t xres = 3840, yres = 2160;
+	int ret = 0;
+
+	if (argc == 3) {
+		xres = strtoul(argv[1], NULL, 0);
+		yres = strtoul(argv[2], NULL, 0);
+	} else if (argc != 1) {
+		fprintf(stderr, "usage: %s [xres yres]\n", argv[0]);
+		return 1;
+	}
+
+	ret |= bench("vmalloc", 0, xres, yres);
+	ret |= bench("contig", VFB2_FLAG_CONTIG, xres, yres);
+	return ret;
+}
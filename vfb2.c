@@ -32,7 +32,22 @@
 #include <linux/fb.h>
 #include <linux/init.h>
 #include <linux/rwsem.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/pagemap.h>
+#include <linux/rmap.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/poll.h>
+#include <linux/kref.h>
+#include <linux/rcupdate.h>
+#include <linux/highmem.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/sort.h>
 #include <asm/atomic.h>
+#include <asm/uaccess.h>
 
 #include "vfb2.h"
 
@@ -43,6 +58,76 @@
 #warning : Make sure you have cfbfillrect, cfbcopyarea and cfbimgblt in the kernel or as modules (If unsure, compile kernel with CONFIG_FB_VESA).
 #endif
 
+/* write protected mappings need page_mkwrite returning a locked page */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,31)
+#define VFB2_HAVE_DEFIO
+#endif
+
+/* VM_RESERVED was removed in 3.7 */
+#ifndef VM_RESERVED
+#define VM_RESERVED		(VM_DONTEXPAND | VM_DONTDUMP)
+#endif
+
+/* vmalloc_user memory can be mapped in one go by remap_vmalloc_range */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,18)
+#define VFB2_HAVE_VMALLOC_USER
+#endif
+
+/* split_page, so that high order pages can be mapped page by page */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,18)
+#define VFB2_HAVE_CONTIG
+#define VFB2_CONTIG_FLAGS	VFB2_FLAG_CONTIG
+#else
+#define VFB2_CONTIG_FLAGS	0
+#endif
+
+/* vfb2_get_tiles hashes on all cpus */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,27)
+#define VFB2_HAVE_TILES
+#include <linux/cpu.h>
+#include <linux/workqueue.h>
+#include <asm/unaligned.h>
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,27)
+#define trylock_page(page)	(!TestSetPageLocked(page))
+#endif
+
+/* 64 bit divisions have to go through helpers on 32 bit */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+#include <linux/math64.h>
+#else
+#include <asm/div64.h>
+/* the counters are longs there, the divisor fits into 32 bits */
+static inline u64 div64_u64(u64 dividend, u64 divisor)
+{
+	do_div(dividend, (u32)divisor);
+	return dividend;
+}
+
+static inline s64 div_s64(s64 dividend, s32 divisor)
+{
+	u64 q = dividend < 0 ? -dividend : dividend;
+
+	do_div(q, divisor < 0 ? -divisor : divisor);
+	return ((dividend < 0) != (divisor < 0)) ? -(s64)q : (s64)q;
+}
+#endif
+
+/* vfb2_trace.h needs DECLARE_EVENT_CLASS */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,33)
+#define CREATE_TRACE_POINTS
+#include "vfb2_trace.h"
+#else
+#define trace_vfb2_fillrect(index, dx, dy, width, height)
+#define trace_vfb2_copyarea(index, dx, dy, width, height)
+#define trace_vfb2_imageblit(index, dx, dy, width, height)
+#define trace_vfb2_fault(index, pgoff, write)
+#define trace_vfb2_set_par(index, mode, xres, yres, bpp)
+#define trace_vfb2_harvest(index, rects, pages, bytes)
+#define trace_vfb2_ioctl(index, cmd, ret, ns)
+#endif
+
 #define err(format, arg...) printk(KERN_ERR "vfb2: " format "\n" , ## arg)
 
 #define VFB2_PRESENT		1
@@ -50,90 +135,532 @@
 /* TODO: rename to VFB2_NOT_REGISTERED */
 #define VFB2_ERROR_ON_REGISTER	-1
 
+/* writers and snapshots of the same band of the video memory exclude each
+ * other, see vfb2_write_begin */
+#define VFB2_SEQ_BANDS		64
+
+/* read and write copy at most this much between two cond_resched */
+#define VFB2_RW_CHUNK		(1024 * 1024)
+
+#ifdef VFB2_HAVE_DEFIO
+#define VFB2_SUPPORTED_FLAGS	(VFB2_FLAG_DAMAGE | VFB2_FLAG_DEFIO | \
+				 VFB2_FLAG_BUFFERING | VFB2_FLAG_LAZY_VMEM | \
+				 VFB2_FLAG_RESIZE_VMEM | VFB2_FLAG_SHADOW | \
+				 VFB2_FLAG_CURSOR | VFB2_CONTIG_FLAGS)
+#else
+#define VFB2_SUPPORTED_FLAGS	(VFB2_FLAG_DAMAGE | VFB2_FLAG_BUFFERING | \
+				 VFB2_FLAG_RESIZE_VMEM | VFB2_FLAG_SHADOW | \
+				 VFB2_FLAG_CURSOR | VFB2_CONTIG_FLAGS)
+#endif
+
+/* per device, so that busy devices do not slow down each other */
+struct vfb2_stats {
+	vfb2_counter_t fillrect;
+	vfb2_counter_t fillrect_pixels;
+	vfb2_counter_t copyarea;
+	vfb2_counter_t copyarea_pixels;
+	vfb2_counter_t imageblit;
+	vfb2_counter_t imageblit_pixels;
+	vfb2_counter_t mmap;
+	vfb2_counter_t fault;
+	vfb2_counter_t write_fault;
+	vfb2_counter_t mode_switch;
+	vfb2_counter_t ioctl;
+	vfb2_counter_t ioctl_ns;
+	vfb2_counter_t damage_bytes;
+	vfb2_counter_t harvested_bytes;
+	vfb2_counter_t delta_bytes;
+	vfb2_counter_t cow_pages;
+};
+
+#define vfb2_count(dev, counter, n) \
+	vfb2_counter_add((n), &(dev)->stats.counter)
+
+/* sorted by xres, yres, bpp and index, for vfb2_match_mode */
+struct vfb2_mode_key {
+	u32 xres;
+	u32 yres;
+	u32 bpp;
+	u32 index;
+	/* the lowest index with the same xres and yres */
+	u32 first;
+};
+
+/* precomputed for each entry of the mode table */
+struct vfb2_mode_info {
+	u32 line_length;
+	struct fb_bitfield red;
+	struct fb_bitfield green;
+	struct fb_bitfield blue;
+	struct fb_bitfield transp;
+};
+
+/* VFB2_FLAG_CONTIG: the video memory as chunks of 1 << order physically
+ * contiguous pages. Only the allocation is contiguous, the vmap and the
+ * user mappings still use single page ptes. */
+struct vfb2_contig {
+	void *vaddr;
+	/* vaddr is a vmap of the chunks, not the linear mapping */
+	int mapped;
+	unsigned int order;
+	unsigned long num_pages;
+	struct page *chunk[0];
+};
+
+/* vfb2_get_tiles: the tile hashes at the last call and the layout they
+ * were computed for */
+struct vfb2_tile_state {
+	struct mutex lock;
+	u64 *hash;
+	u8 *changed;
+	u32 columns;
+	u32 rows;
+	u32 xres;
+	u32 yres;
+	u32 line_length;
+	u32 bpp;
+};
+
+struct vfb2_device;
+
+/* a secondary consumer, with damage, events and dirty pages of its own */
+struct vfb2_client {
+	struct vfb2_device *dev;
+	struct list_head list;
+	struct vfb2_damage damage;
+	unsigned int events;
+	unsigned long *dirty_pages;
+	struct mutex dirty_lock;
+	void (*notify)(unsigned int events, void *private);
+	void *private;
+	struct vfb2_tile_state tiles;
+};
+
 struct vfb2_device {
 	struct vfb2_init init;
+	int num_modes;
+	struct vfb2_mode_key *mode_index;
+	struct vfb2_mode_info *mode_info;
 	int present;
 	int table_index;
-	/* TODO: use kref instead of open counter */
-	atomic_t open;
+	/* one reference for the registrant and one for each open */
+	struct kref ref;
 	int current_mode;
+	u32 yoffset;
 	void *videomemory;
+	/* allocated size, init.vmem_len is the maximum */
+	unsigned long vmem_len;
+	atomic_t mmap_count;
+	/* VFB2_FLAG_LAZY_VMEM: the pages, NULL until first written. The
+	 * kernel mapping in videomemory is created on first kernel use. */
+	struct page **pages;
+	struct vfb2_contig *contig;
+	spinlock_t vmem_lock;
+	/* serializes mapping and resizing of the video memory */
+	struct mutex vmem_mutex;
+	/* read() and write() hold it shared across their copies, a resize
+	 * exclusively, taken before vmem_mutex. The copies may fault on
+	 * mappings, so they can not hold vmem_mutex. */
+	struct rw_semaphore rw_sem;
+	struct address_space *mapping;
 	struct fb_info *info;
 	struct rw_semaphore ioctl_sem;
+	spinlock_t damage_lock;
+	struct vfb2_damage damage;
+	struct mutex dirty_lock;
+	unsigned long *dirty_pages;
+	spinlock_t event_lock;
+	unsigned int events;
+	wait_queue_head_t event_wait;
+	struct vfb2_stats stats;
+	struct dentry *debugfs;
+	/* VFB2_FLAG_SHADOW: what the client got from vfb2_get_delta, sized
+	 * for init.vmem_len and protected by vmem_mutex */
+	u8 *shadow;
+	/* the pseudocolor palette as clients get it */
+	spinlock_t palette_lock;
+	struct vfb2_palette palette;
+	/* VFB2_FLAG_CURSOR, set by the console from a timer */
+	spinlock_t cursor_lock;
+	struct vfb2_cursor cursor;
+	/* struct vfb2_client, their damage and events are protected by
+	 * client_lock as well */
+	struct list_head clients;
+	spinlock_t client_lock;
+	struct vfb2_tile_state tiles;
+	/* per band of init.vmem_len: writers at work and finished writes,
+	 * frame_seq counts all writes */
+	atomic_t band_writers[VFB2_SEQ_BANDS];
+	atomic_t band_seq[VFB2_SEQ_BANDS];
+	atomic_t frame_seq;
+	/* struct vfb2_cow, their pages are protected by cow_lock as well */
+	struct list_head cows;
+	spinlock_t cow_lock;
+	/* taken before cow_lock, keeps the mappings of the snapshots while
+	 * a write zaps them */
+	struct mutex cow_mutex;
+};
+
+/* A frame frozen by vfb2_cow_create. pages[i] starts out as the live page
+ * and is replaced by a copy before the first write afterwards, NULL is a
+ * lazy page that was not allocated yet and reads as zeros. A live page
+ * handed out by vfb2_cow_get_page is marked in lent, its mappings are
+ * zapped when it is copied. */
+struct vfb2_cow {
+	struct kref ref;
+	/* holds a reference */
+	struct vfb2_device *dev;
+	struct list_head list;
+	/* a copy could not be allocated or a lent page could not be taken
+	 * back, a later write went through */
+	int broken;
+	u32 seq;
+	int mode;
+	u32 yoffset;
+	/* set by vfb2_cow_map under cow_mutex and cow_lock */
+	struct address_space *mapping;
+	unsigned long map_pgoff;
+	int map_count;
+	unsigned long *lent;
+	unsigned long num_pages;
+	struct page *pages[0];
 };
 
 #define VFB2_MAX_DEVICES	FB_MAX
+/* readers use rcu, vfb2_table_lock only serializes writers */
 static struct vfb2_device *vfb2_table[VFB2_MAX_DEVICES] = { 0 };
-static DECLARE_RWSEM(vfb2_table_sem);
+static DEFINE_SPINLOCK(vfb2_table_lock);
+
+static struct dentry *vfb2_debugfs;
 
 static void vfb2_remove(struct vfb2_device *dev);
 
-static int vfb2_find_dev(struct vfb2_device *dev)
+static void vfb2_release_dev(struct kref *ref)
 {
-	int i;
-	int ret = -1;
+	vfb2_remove(container_of(ref, struct vfb2_device, ref));
+}
 
-	for (i=0; i<VFB2_MAX_DEVICES; i++)
-		if (vfb2_table[i] == dev) {
-			ret = i;
-			break;
-		}
+static inline void vfb2_put_dev(struct vfb2_device *dev)
+{
+	kref_put(&dev->ref, vfb2_release_dev);
+}
 
-	return ret;
+/* must be called within rcu_read_lock */
+static struct vfb2_device *vfb2_index_to_dev(int index)
+{
+	if ((index < 0) || (index >= VFB2_MAX_DEVICES))
+		return NULL;
+	return rcu_dereference(vfb2_table[index]);
 }
 
-static inline struct vfb2_device *vfb2_get_dev(struct fb_info *info)
+/* for callers that need to sleep, release with vfb2_put_dev */
+static struct vfb2_device *vfb2_index_get_dev(int index)
 {
 	struct vfb2_device *dev;
 
+	rcu_read_lock();
+	dev = vfb2_index_to_dev(index);
+	/* the registrant's reference is dropped only after the device has
+	 * been removed from the table and a grace period has passed */
+	if (dev)
+		kref_get(&dev->ref);
+	rcu_read_unlock();
+	return dev;
+}
+
+/* info->par stays valid as long as the frame buffer is registered, and it
+ * is unregistered only after the last reference is gone */
+static inline struct vfb2_device *vfb2_get_dev(struct fb_info *info)
+{
 	if (!info)
 		return NULL;
-	dev = (struct vfb2_device *)info->par;
-	if (!dev)
-		return NULL;
-	if (vfb2_find_dev(dev) < 0)
-		return NULL;
-	return dev;
+	return (struct vfb2_device *)info->par;
 }
 
 static struct vfb2_device *vfb2_get_present_dev(struct fb_info *info)
 {
-	struct vfb2_device *dev;
+	struct vfb2_device *dev = vfb2_get_dev(info);
 
-	down_read(&vfb2_table_sem);
-	dev = vfb2_get_dev(info);
-	if (!dev)
-		goto exit;
-	if (dev->present == VFB2_NOT_PRESENT)
-		dev = NULL;
-exit:
-	up_read(&vfb2_table_sem);
+	if (!dev || (dev->present != VFB2_PRESENT))
+		return NULL;
 	return dev;
 }
 
-static int vfb2_match_mode(struct vfb2_device *dev,
-			   struct fb_var_screeninfo *var)
+static void vfb2_signal_event(struct vfb2_device *dev, unsigned int events)
 {
-	struct vfb2_mode *mode_table = dev->init.mode_table;
-	int i;
-	int mode = -1;
+	unsigned long flags;
 
-	for (i=0; mode_table[i].xres; i++)
-		if ((mode_table[i].xres == var->xres) &&
-		    (mode_table[i].yres == var->yres)) {
-			mode = i;
-			break;
+	struct vfb2_client *client;
+
+	spin_lock_irqsave(&dev->event_lock, flags);
+	dev->events |= events;
+	spin_unlock_irqrestore(&dev->event_lock, flags);
+
+	spin_lock_irqsave(&dev->client_lock, flags);
+	list_for_each_entry(client, &dev->clients, list) {
+		client->events |= events;
+		if (client->notify)
+			client->notify(events, client->private);
+	}
+	spin_unlock_irqrestore(&dev->client_lock, flags);
+	/* the clients wait here as well */
+	wake_up_interruptible(&dev->event_wait);
+
+	if (dev->init.vfb2_notify) {
+		/* vfb2_unregister waits for a grace period after clearing
+		 * present, so the registrant can free its data then */
+		rcu_read_lock();
+		if (dev->present == VFB2_PRESENT)
+			dev->init.vfb2_notify(events, dev->table_index);
+		rcu_read_unlock();
+	}
+}
+
+static unsigned int vfb2_fetch_events(struct vfb2_device *dev,
+				      unsigned int mask)
+{
+	unsigned long flags;
+	unsigned int events;
+
+	spin_lock_irqsave(&dev->event_lock, flags);
+	events = dev->events & mask;
+	dev->events &= ~mask;
+	spin_unlock_irqrestore(&dev->event_lock, flags);
+	return events;
+}
+
+static inline int vfb2_rect_overlap(struct vfb2_rect *a, struct vfb2_rect *b)
+{
+	/* touching rectangles count as overlapping, so that consecutive
+	 * console lines end up in one rectangle */
+	return (a->x <= b->x + b->width) && (b->x <= a->x + a->width) &&
+	       (a->y <= b->y + b->height) && (b->y <= a->y + a->height);
+}
+
+static inline void vfb2_rect_union(struct vfb2_rect *a, struct vfb2_rect *b)
+{
+	u32 x2 = max(a->x + a->width, b->x + b->width);
+	u32 y2 = max(a->y + a->height, b->y + b->height);
+
+	a->x = min(a->x, b->x);
+	a->y = min(a->y, b->y);
+	a->width = x2 - a->x;
+	a->height = y2 - a->y;
+}
+
+static inline u64 vfb2_rect_area(struct vfb2_rect *r)
+{
+	return (u64)r->width * r->height;
+}
+
+static void vfb2_merge_damage(struct vfb2_damage *damage, struct vfb2_rect *r)
+{
+	struct vfb2_rect u;
+	unsigned int i, best;
+	u64 cost, best_cost;
+
+again:
+	for (i=0; i<damage->count; i++)
+		if (vfb2_rect_overlap(&damage->rect[i], r)) {
+			vfb2_rect_union(r, &damage->rect[i]);
+			damage->rect[i] = damage->rect[--damage->count];
+			goto again;
 		}
 
-	for (i=0; mode_table[i].xres; i++)
-		if ((mode_table[i].xres == var->xres) &&
-		    (mode_table[i].yres == var->yres) &&
-		    (mode_table[i].bpp == var->bits_per_pixel)) {
-			mode = i;
-			break;
+	if (damage->count == VFB2_MAX_DAMAGE_RECTS) {
+		/* no free slot, merge with the rect that grows the least */
+		best = 0;
+		best_cost = ~0ULL;
+		for (i=0; i<damage->count; i++) {
+			u = damage->rect[i];
+			vfb2_rect_union(&u, r);
+			cost = vfb2_rect_area(&u) -
+			       vfb2_rect_area(&damage->rect[i]);
+			if (cost < best_cost) {
+				best_cost = cost;
+				best = i;
+			}
 		}
+		vfb2_rect_union(r, &damage->rect[best]);
+		damage->rect[best] = damage->rect[--damage->count];
+		goto again;
+	}
+
+	damage->rect[damage->count++] = *r;
+}
+
+static void vfb2_add_damage(struct vfb2_device *dev, u32 x, u32 y,
+			    u32 width, u32 height)
+{
+	struct fb_var_screeninfo *var;
+	struct vfb2_client *client;
+	struct vfb2_rect r, c;
+	unsigned long flags;
+
+	/* consumers that did not ask for damage are not woken either */
+	if (!dev || !(dev->init.flags & VFB2_FLAG_DAMAGE))
+		return;
+
+	var = &dev->info->var;
+	if ((x >= var->xres_virtual) || (y >= var->yres_virtual))
+		return;
+	r.x = x;
+	r.y = y;
+	r.width = min(width, var->xres_virtual - x);
+	r.height = min(height, var->yres_virtual - y);
+	if (!r.width || !r.height)
+		return;
+
+	vfb2_count(dev, damage_bytes,
+		   vfb2_rect_area(&r) * var->bits_per_pixel >> 3);
+	spin_lock_irqsave(&dev->damage_lock, flags);
+	vfb2_merge_damage(&dev->damage, &r);
+	spin_unlock_irqrestore(&dev->damage_lock, flags);
+
+	spin_lock_irqsave(&dev->client_lock, flags);
+	list_for_each_entry(client, &dev->clients, list) {
+		c = r;
+		vfb2_merge_damage(&client->damage, &c);
+	}
+	spin_unlock_irqrestore(&dev->client_lock, flags);
+	vfb2_signal_event(dev, VFB2_EVENT_DAMAGE);
+}
+
+/* a page of the video memory was written, dev->dirty_pages has to exist */
+static void vfb2_set_dirty(struct vfb2_device *dev, unsigned long pgoff)
+{
+	struct vfb2_client *client;
+	unsigned long flags;
+
+	if (!test_and_set_bit(pgoff, dev->dirty_pages))
+		vfb2_count(dev, damage_bytes, PAGE_SIZE);
+	spin_lock_irqsave(&dev->client_lock, flags);
+	list_for_each_entry(client, &dev->clients, list)
+		if (client->dirty_pages)
+			set_bit(pgoff, client->dirty_pages);
+	spin_unlock_irqrestore(&dev->client_lock, flags);
+}
+
+/* the bytes of the video memory a rectangle of the virtual screen covers,
+ * returns 0 and an empty range if it is outside */
+static int vfb2_rect_range(struct fb_info *info, u32 x, u32 y, u32 width,
+			   u32 height, unsigned long *start, unsigned long *end)
+{
+	struct fb_var_screeninfo *var = &info->var;
+	u32 bpp = var->bits_per_pixel;
+
+	*start = *end = 0;
+	if ((x >= var->xres_virtual) || (y >= var->yres_virtual) ||
+	    !width || !height)
+		return 0;
+	width = min(width, var->xres_virtual - x);
+	height = min(height, var->yres_virtual - y);
+	*start = (unsigned long)y * info->fix.line_length + x * bpp / 8;
+	*end = (unsigned long)(y + height - 1) * info->fix.line_length +
+	       ((x + width) * bpp + 7) / 8;
+	return 1;
+}
+
+static inline unsigned long vfb2_band_size(struct vfb2_device *dev)
+{
+	return max_t(unsigned long,
+		     DIV_ROUND_UP(dev->init.vmem_len, VFB2_SEQ_BANDS), 1);
+}
+
+/* Brackets a write to the bytes from start up to end, like a seqcount
+ * that allows several writers. vfb2_snapshot retries while a band it
+ * copies has writers or its count changed. */
+static void vfb2_write_begin(struct vfb2_device *dev, unsigned long start,
+			     unsigned long end)
+{
+	unsigned long b, size = vfb2_band_size(dev);
+
+	if (end <= start)
+		return;
+	for (b = start / size; b <= (end - 1) / size; b++)
+		atomic_inc(&dev->band_writers[b]);
+	/* the counters before the pixels */
+	smp_mb();
+}
+
+static void vfb2_write_end(struct vfb2_device *dev, unsigned long start,
+			   unsigned long end)
+{
+	unsigned long b, size = vfb2_band_size(dev);
+
+	if (end <= start)
+		return;
+	/* the pixels before the counters */
+	smp_mb();
+	for (b = start / size; b <= (end - 1) / size; b++)
+		atomic_inc(&dev->band_seq[b]);
+	smp_mb();
+	for (b = start / size; b <= (end - 1) / size; b++)
+		atomic_dec(&dev->band_writers[b]);
+	atomic_inc(&dev->frame_seq);
+}
+
+static void vfb2_take_damage(struct vfb2_device *dev,
+			     struct vfb2_damage *damage)
+{
+	unsigned long flags;
+	u64 bytes = 0;
+	unsigned int i;
+
+	vfb2_fetch_events(dev, VFB2_EVENT_DAMAGE);
+	spin_lock_irqsave(&dev->damage_lock, flags);
+	memcpy(damage, &dev->damage, sizeof(struct vfb2_damage));
+	dev->damage.count = 0;
+	spin_unlock_irqrestore(&dev->damage_lock, flags);
+
+	for (i=0; i<damage->count; i++)
+		bytes += vfb2_rect_area(&damage->rect[i]);
+	bytes = bytes * dev->info->var.bits_per_pixel >> 3;
+	vfb2_count(dev, harvested_bytes, bytes);
+	trace_vfb2_harvest(dev->table_index, damage->count, 0, bytes);
+}
+
+static int vfb2_mode_key_cmp(const struct vfb2_mode_key *a, u32 xres,
+			     u32 yres, u32 bpp)
+{
+	if (a->xres != xres)
+		return (a->xres < xres) ? -1 : 1;
+	if (a->yres != yres)
+		return (a->yres < yres) ? -1 : 1;
+	if (a->bpp != bpp)
+		return (a->bpp < bpp) ? -1 : 1;
+	return 0;
+}
+
+/* the first mode with the resolution and depth of var, otherwise the first
+ * mode with its resolution, -1 if there is none */
+static int vfb2_match_mode(struct vfb2_device *dev,
+			   struct fb_var_screeninfo *var)
+{
+	struct vfb2_mode_key *key = dev->mode_index;
+	int lo = 0, hi = dev->num_modes, mid;
+
+	/* lower bound, equal keys are sorted by index */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (vfb2_mode_key_cmp(&key[mid], var->xres, var->yres,
+				      var->bits_per_pixel) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-	return mode;
+	if (lo < dev->num_modes) {
+		if (!vfb2_mode_key_cmp(&key[lo], var->xres, var->yres,
+				       var->bits_per_pixel))
+			return key[lo].index;
+		if ((key[lo].xres == var->xres) && (key[lo].yres == var->yres))
+			return key[lo].first;
+	}
+	if ((lo > 0) && (key[lo-1].xres == var->xres) &&
+	    (key[lo-1].yres == var->yres))
+		return key[lo-1].first;
+	return -1;
 }
 
 static inline void vfb2_set_mode(struct vfb2_device *dev,
@@ -148,13 +675,7 @@ static inline void vfb2_set_mode(struct vfb2_device *dev,
 
 static inline u_long vfb2_line_length(struct vfb2_device *dev, int mode)
 {
-	struct vfb2_mode *mode_table = dev->init.mode_table;
-	u_long length;
-
-	length = mode_table[mode].xres * mode_table[mode].bpp;
-	length = (length + 7) & ~7;
-	length >>= 3;
-	return length;
+	return dev->mode_info[mode].line_length;
 }
 
 static void vfb2_set_bitfields(struct fb_var_screeninfo *var, int mode_16bpp)
@@ -207,32 +728,45 @@ static int vfb2_check_var_helper(struct fb_var_screeninfo *var,
 				 struct vfb2_device *dev)
 {
 	int mode;
+	u_long frame_len;
+	u32 buffers;
 
 	mode = vfb2_match_mode(dev, var);
 	if (mode < 0)
 		mode = dev->current_mode;
+	/* the modes were checked by vfb2_build_mode_index */
 	vfb2_set_mode(dev, var, mode);
 
-	if ((!var->xres) || (!var->yres))
-		return -EINVAL;
-	if ((var->bits_per_pixel != 1) &&
-	    (var->bits_per_pixel != 8) &&
-	    (var->bits_per_pixel != 16) &&
-	    (var->bits_per_pixel != 24) &&
-	    (var->bits_per_pixel != 32))
-		return -ENOTSUPP;
-
-	if (vfb2_line_length(dev, mode) * var->yres > dev->init.vmem_len)
+	frame_len = vfb2_line_length(dev, mode) * var->yres;
+	if (frame_len > dev->init.vmem_len)
 		return -ENOMEM;
 
+	buffers = 1;
+	if (dev->init.flags & VFB2_FLAG_BUFFERING) {
+		buffers = var->yres_virtual / var->yres;
+		buffers = min(buffers, (u32)VFB2_MAX_BUFFERS);
+		buffers = min(buffers, (u32)(dev->init.vmem_len / frame_len));
+		buffers = max(buffers, 1U);
+	}
+
+	/* mapped memory can not be resized */
+	if ((dev->init.flags & VFB2_FLAG_RESIZE_VMEM) &&
+	    atomic_read(&dev->mmap_count) &&
+	    (frame_len * buffers > dev->vmem_len))
+		return -EBUSY;
+
 	var->xres_virtual = var->xres;
-	var->yres_virtual = var->yres;
+	var->yres_virtual = var->yres * buffers;
 	var->xoffset = 0;
-	var->yoffset = 0;
+	if (var->yoffset > var->yres_virtual - var->yres)
+		var->yoffset = 0;
 	var->grayscale = 0;
 	var->activate = FB_ACTIVATE_NOW;
 	var->vmode = FB_VMODE_NONINTERLACED;
-	vfb2_set_bitfields(var, dev->init.mode_table[mode].transp_mode);
+	var->red = dev->mode_info[mode].red;
+	var->green = dev->mode_info[mode].green;
+	var->blue = dev->mode_info[mode].blue;
+	var->transp = dev->mode_info[mode].transp;
 
 	return 0;
 }
@@ -246,17 +780,37 @@ static int vfb2_check_var(struct fb_var_screeninfo *var, struct fb_info *info)
 	return vfb2_check_var_helper(var, dev);
 }
 
+static int vfb2_resize_vmem(struct vfb2_device *dev, unsigned long size);
+
 static int vfb2_set_par_helper(struct fb_info *info, struct vfb2_device *dev)
 {
 	int mode;
+	int res;
 
 	mode = vfb2_match_mode(dev, &info->var);
 	if (mode < 0)
 		return -EINVAL;
 
+	if (dev->init.flags & VFB2_FLAG_RESIZE_VMEM) {
+		down_write(&dev->rw_sem);
+		mutex_lock(&dev->vmem_mutex);
+		res = vfb2_resize_vmem(dev, vfb2_line_length(dev, mode) *
+					    info->var.yres_virtual);
+		mutex_unlock(&dev->vmem_mutex);
+		up_write(&dev->rw_sem);
+		if (res < 0)
+			return res;
+	}
+
 	info->fix.line_length = vfb2_line_length(dev, mode);
 	info->fix.visual = dev->init.mode_table[mode].visual;
+	info->fix.ypanstep = (info->var.yres_virtual > info->var.yres) ? 1 : 0;
 	dev->current_mode = mode;
+	dev->yoffset = info->var.yoffset;
+	vfb2_count(dev, mode_switch, 1);
+	trace_vfb2_set_par(dev->table_index, mode, info->var.xres,
+			   info->var.yres, info->var.bits_per_pixel);
+	vfb2_signal_event(dev, VFB2_EVENT_MODE);
 
 	return 0;
 }
@@ -264,167 +818,599 @@ static int vfb2_set_par_helper(struct fb_info *info, struct vfb2_device *dev)
 static int vfb2_set_par(struct fb_info *info)
 {
 	struct vfb2_device *dev = vfb2_get_present_dev(info);
+	int ret;
 
 	if (!dev)
 		return -ENODEV;
-	return vfb2_set_par_helper(info, dev);
+	/* the layout of all of the video memory changes */
+	vfb2_write_begin(dev, 0, dev->init.vmem_len);
+	ret = vfb2_set_par_helper(info, dev);
+	vfb2_write_end(dev, 0, dev->init.vmem_len);
+	return ret;
 }
 
-static int vfb2_setcolreg(u_int regno, u_int red, u_int green, u_int blue,
-			  u_int transp, struct fb_info *info)
+static int vfb2_pan_display(struct fb_var_screeninfo *var,
+			    struct fb_info *info)
 {
 	struct vfb2_device *dev = vfb2_get_present_dev(info);
 
 	if (!dev)
 		return -ENODEV;
 
-	if (regno >= 256)
-		return 1;
+	if (var->xoffset ||
+	    (var->yoffset + info->var.yres > info->var.yres_virtual))
+		return -EINVAL;
 
-#define CNVT_TOHW(val,width) ((((val)<<(width))+0x7FFF-(val))>>16)
+	dev->yoffset = var->yoffset;
+	vfb2_signal_event(dev, VFB2_EVENT_PAN);
+	return 0;
+}
+
+/* bits per component of the hardware color, looked up once per call */
+static void vfb2_color_lengths(struct fb_info *info, u32 *len)
+{
 	switch (info->fix.visual) {
-	case FB_VISUAL_TRUECOLOR:
-	case FB_VISUAL_PSEUDOCOLOR:
-		red = CNVT_TOHW(red, info->var.red.length);
-		green = CNVT_TOHW(green, info->var.green.length);
-		blue = CNVT_TOHW(blue, info->var.blue.length);
-		transp = CNVT_TOHW(transp, info->var.transp.length);
-		break;
 	case FB_VISUAL_DIRECTCOLOR:
-		red = CNVT_TOHW(red, 8);
-		green = CNVT_TOHW(green, 8);
-		blue = CNVT_TOHW(blue, 8);
-		transp = CNVT_TOHW(transp, 8);
+		len[0] = len[1] = len[2] = len[3] = 8;
+		break;
+	default:
+		len[0] = info->var.red.length;
+		len[1] = info->var.green.length;
+		len[2] = info->var.blue.length;
+		len[3] = info->var.transp.length;
 		break;
 	}
-#undef CNVT_TOHW
-
-	if (info->fix.visual == FB_VISUAL_TRUECOLOR) {
-		u32 v;
+}
 
-		if (regno >= 16)
-			return 1;
+/* called with palette_lock held, 1 if regno has no entry, sets *changed
+ * if dev->palette changed, a truecolor visual only has the pseudo palette */
+static int __vfb2_setcolreg(struct vfb2_device *dev, struct fb_info *info,
+			    const u32 *len, u_int regno, u_int red,
+			    u_int green, u_int blue, u_int transp,
+			    int *changed)
+{
+	u32 v;
 
-		v = (red << info->var.red.offset) |
-		    (green << info->var.green.offset) |
-		    (blue << info->var.blue.offset) |
-		    (transp << info->var.transp.offset);
-		switch (info->var.bits_per_pixel) {
-		case 16:
-		case 24:
-		case 32:
-			((u32 *) (info->pseudo_palette))[regno] = v;
-			break;
+	if (regno >= VFB2_PALETTE_SIZE)
+		return 1;
+	if (info->fix.visual != FB_VISUAL_TRUECOLOR) {
+		v = ((red >> 8) << 16) | ((green >> 8) << 8) | (blue >> 8);
+		if (dev->palette.color[regno] != v) {
+			dev->palette.color[regno] = v;
+			*changed = 1;
 		}
 		return 0;
 	}
+	if (regno >= 16)
+		return 1;
+
+#define CNVT_TOHW(val,width) ((((val)<<(width))+0x7FFF-(val))>>16)
+	v = (CNVT_TOHW(red, len[0]) << info->var.red.offset) |
+	    (CNVT_TOHW(green, len[1]) << info->var.green.offset) |
+	    (CNVT_TOHW(blue, len[2]) << info->var.blue.offset) |
+	    (CNVT_TOHW(transp, len[3]) << info->var.transp.offset);
+#undef CNVT_TOHW
+	switch (info->var.bits_per_pixel) {
+	case 16:
+	case 24:
+	case 32:
+		((u32 *) (info->pseudo_palette))[regno] = v;
+		break;
+	}
 	return 0;
 }
 
-static int vfb2_open(struct fb_info *info, int user)
+static int vfb2_setcolreg(u_int regno, u_int red, u_int green, u_int blue,
+			  u_int transp, struct fb_info *info)
 {
-	struct vfb2_device *dev;
-	int ret = -ENODEV;
+	struct vfb2_device *dev = vfb2_get_present_dev(info);
+	unsigned long flags;
+	u32 len[4];
+	int ret, changed = 0;
 
-	down_read(&vfb2_table_sem);
-	dev = vfb2_get_dev(info);
 	if (!dev)
-		goto error;
-	if (dev->present == VFB2_NOT_PRESENT)
-		goto error;
-	atomic_inc(&dev->open);
-	ret = 0;
-error:
-	up_read(&vfb2_table_sem);
+		return -ENODEV;
+
+	vfb2_color_lengths(info, len);
+	spin_lock_irqsave(&dev->palette_lock, flags);
+	ret = __vfb2_setcolreg(dev, info, len, regno, red, green, blue,
+			       transp, &changed);
+	if (changed)
+		dev->palette.serial++;
+	spin_unlock_irqrestore(&dev->palette_lock, flags);
+	if (changed)
+		vfb2_signal_event(dev, VFB2_EVENT_PALETTE);
 	return ret;
 }
 
-static int vfb2_release(struct fb_info *info, int user)
+/* the whole cmap with one lookup and one event, the fb core would call
+ * vfb2_setcolreg for every entry */
+static int vfb2_setcmap(struct fb_cmap *cmap, struct fb_info *info)
 {
-	struct vfb2_device *dev;
-	int remove = 0;
-	int ret = 0;
+	struct vfb2_device *dev = vfb2_get_present_dev(info);
+	unsigned long flags;
+	u32 len[4], i;
+	int changed = 0;
 
-	down_read(&vfb2_table_sem);
-	dev = vfb2_get_dev(info);
-	if (!dev) {
-		ret = -ENODEV;
-		goto error;
-	}
-	if (atomic_dec_and_test(&dev->open) &&
-	    (dev->present == VFB2_NOT_PRESENT))
-		remove = 1;
-error:
-	up_read(&vfb2_table_sem);
+	if (!dev)
+		return -ENODEV;
 
-	if (remove)
-		vfb2_remove(dev);
+	vfb2_color_lengths(info, len);
+	spin_lock_irqsave(&dev->palette_lock, flags);
+	/* like the fb core, stops quietly at the first entry without a
+	 * register */
+	for (i=0; i<cmap->len; i++)
+		if (__vfb2_setcolreg(dev, info, len, cmap->start + i,
+				     cmap->red[i], cmap->green[i],
+				     cmap->blue[i],
+				     cmap->transp ? cmap->transp[i] : 0xffff,
+				     &changed))
+			break;
+	if (changed)
+		dev->palette.serial++;
+	spin_unlock_irqrestore(&dev->palette_lock, flags);
+	if (changed)
+		vfb2_signal_event(dev, VFB2_EVENT_PALETTE);
+	return 0;
+}
 
-	return ret;
+static inline unsigned long vfb2_num_pages(struct vfb2_device *dev)
+{
+	return dev->vmem_len >> PAGE_SHIFT;
 }
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,16)
-static int vfb2_ioctl(struct inode *inode, struct file *file,
-		      unsigned int cmd, unsigned long arg,
-		      struct fb_info *info)
-#else
-static int vfb2_ioctl(struct fb_info *info, unsigned int cmd,
-		      unsigned long arg)
-#endif
+/* returns NULL if a lazy page was not allocated yet */
+static struct page *vfb2_vmem_page(struct vfb2_device *dev,
+				   unsigned long pgoff)
 {
-	struct vfb2_device *dev = vfb2_get_present_dev(info);
-	int ret = -ENODEV;
+	if (dev->contig)
+		return dev->contig->chunk[pgoff >> dev->contig->order] +
+		       (pgoff & ((1UL << dev->contig->order) - 1));
+	if (!dev->pages)
+		return vmalloc_to_page(dev->videomemory +
+				       (pgoff << PAGE_SHIFT));
+	return ACCESS_ONCE(dev->pages[pgoff]);
+}
 
-	if (!dev)
-		return -ENODEV;
+/* like vfb2_vmem_page, but allocates a lazy page if necessary, may sleep */
+static struct page *vfb2_vmem_get_page(struct vfb2_device *dev,
+				       unsigned long pgoff, gfp_t gfp)
+{
+	struct page *page = vfb2_vmem_page(dev, pgoff);
+	struct page *new;
 
-	down_read(&dev->ioctl_sem);
-	if (dev->present == VFB2_NOT_PRESENT)
-		goto error;
+	if (page)
+		return page;
 
-	if (dev->init.vfb2_ioctl)
-		ret = dev->init.vfb2_ioctl(cmd, arg,
-					   dev->table_index);
-	else
-		ret = -ENOIOCTLCMD;
-error:
-	up_read(&dev->ioctl_sem);
-	return ret;
+	new = alloc_page(gfp | __GFP_ZERO);
+	if (!new)
+		return NULL;
+
+	spin_lock(&dev->vmem_lock);
+	page = dev->pages[pgoff];
+	if (!page) {
+		/* the page has to be zeroed before others can see it */
+		smp_wmb();
+		dev->pages[pgoff] = new;
+		page = new;
+		new = NULL;
+	}
+	spin_unlock(&dev->vmem_lock);
+
+	if (new)
+		__free_page(new);
+	/* read-only and private mappings may hold the zero page here */
+	else if (dev->mapping)
+		unmap_mapping_range(dev->mapping, (loff_t)pgoff << PAGE_SHIFT,
+				    PAGE_SIZE, 1);
+	return page;
 }
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,16)
-static int vfb2_mmap(struct fb_info *info, struct file *file,
-		     struct vm_area_struct *vma)
-#else
-static int vfb2_mmap(struct fb_info *info, struct vm_area_struct *vma)
-# endif
+/* called with cow_lock held, 1 if the snapshot still shares the page
+ * with the video memory, not if it was copied or resized meanwhile */
+static int vfb2_cow_shared(struct vfb2_device *dev, struct vfb2_cow *cow,
+			   unsigned long pgoff)
 {
+	struct page *page = cow->pages[pgoff];
+
+	return page && (pgoff < vfb2_num_pages(dev)) &&
+	       (page == vfb2_vmem_page(dev, pgoff));
+}
+
+/* called with cow_lock held on a shared page, moves copy into the snapshot */
+static void __vfb2_cow_install(struct vfb2_device *dev, struct vfb2_cow *cow,
+			       unsigned long pgoff, struct page *copy)
+{
+	struct page *page = cow->pages[pgoff];
+
+	copy_highpage(copy, page);
+	cow->pages[pgoff] = copy;
+	/* the video memory still holds the page */
+	put_page(page);
+	vfb2_count(dev, cow_pages, 1);
+}
+
+/* Called with cow_lock held, maybe in atomic context. Uses *copy if it
+ * is set, 1 if the page was copied after it had been lent out. */
+static int __vfb2_cow_page(struct vfb2_device *dev, struct vfb2_cow *cow,
+			   unsigned long pgoff, struct page **copy)
+{
+	struct page *page = *copy;
+
+	if (!vfb2_cow_shared(dev, cow, pgoff))
+		return 0;
+	if (page)
+		*copy = NULL;
+	else
+		page = alloc_page(GFP_ATOMIC | __GFP_NOWARN);
+	if (!page) {
+		cow->broken = 1;
+		return 0;
+	}
+	__vfb2_cow_install(dev, cow, pgoff, page);
+	return test_and_clear_bit(pgoff, cow->lent);
+}
+
+/* Copies the pages with the bytes from start up to end for the snapshots
+ * that still share them, before they are written. Writes that race with
+ * vfb2_cow_create may or may not end up in the snapshot. For the drawing
+ * ops, which may run in atomic context: a lent page can not be taken back
+ * from a mapping here, so its snapshot breaks instead. */
+static void vfb2_cow_range(struct vfb2_device *dev, unsigned long start,
+			   unsigned long end)
+{
+	struct vfb2_cow *cow;
+	struct page *live, *copy = NULL;
+	unsigned long flags, i;
+
+	if ((end <= start) || list_empty(&dev->cows))
+		return;
+	/* one page at a time, interrupts are off only while it is copied */
+	for (i = start >> PAGE_SHIFT; i <= (end - 1) >> PAGE_SHIFT; i++) {
+		spin_lock_irqsave(&dev->cow_lock, flags);
+		if (list_empty(&dev->cows)) {
+			spin_unlock_irqrestore(&dev->cow_lock, flags);
+			break;
+		}
+		live = vfb2_vmem_page(dev, i);
+		list_for_each_entry(cow, &dev->cows, list) {
+			if ((i >= cow->num_pages) ||
+			    !__vfb2_cow_page(dev, cow, i, &copy))
+				continue;
+			/* a kernel user holds the page locked while it reads */
+			if (cow->mapping || !trylock_page(live))
+				cow->broken = 1;
+			else
+				unlock_page(live);
+		}
+		spin_unlock_irqrestore(&dev->cow_lock, flags);
+	}
+}
+
+/* Like vfb2_cow_range for the single page pgoff, but takes lent pages
+ * back. The caller holds the page lock of the live page, so the faults
+ * that hand it out are finished or see the copy, and may sleep. */
+static void vfb2_cow_page_locked(struct vfb2_device *dev,
+				 unsigned long pgoff)
+{
+	struct vfb2_cow *cow;
+	struct address_space *mapping;
+	struct page *copy = NULL;
+	unsigned long flags;
+	loff_t holebegin;
+
+	if (list_empty(&dev->cows))
+		return;
+	mutex_lock(&dev->cow_mutex);
+again:
+	if (!copy)
+		copy = alloc_page(GFP_HIGHUSER | __GFP_NOWARN);
+	spin_lock_irqsave(&dev->cow_lock, flags);
+	list_for_each_entry(cow, &dev->cows, list) {
+		if ((pgoff >= cow->num_pages) ||
+		    !__vfb2_cow_page(dev, cow, pgoff, &copy) ||
+		    !cow->mapping)
+			continue;
+		/* cow_mutex keeps the mapping while it is zapped, the next
+		 * fault gets the copy */
+		mapping = cow->mapping;
+		holebegin = (loff_t)(cow->map_pgoff + pgoff) << PAGE_SHIFT;
+		spin_unlock_irqrestore(&dev->cow_lock, flags);
+		unmap_mapping_range(mapping, holebegin, PAGE_SIZE, 1);
+		goto again;
+	}
+	spin_unlock_irqrestore(&dev->cow_lock, flags);
+	mutex_unlock(&dev->cow_mutex);
+	if (copy)
+		__free_page(copy);
+}
+
+/* allocates all lazy pages and maps them into the kernel, may sleep,
+ * the caller holds vmem_mutex */
+static int __vfb2_map_vmem(struct vfb2_device *dev)
+{
+	unsigned long i;
+	void *adr;
+	int ret = 0;
+
+	if (!dev->pages || dev->videomemory)
+		return 0;
+
+	ret = -ENOMEM;
+	for (i=0; i<vfb2_num_pages(dev); i++)
+		if (!vfb2_vmem_get_page(dev, i, GFP_HIGHUSER))
+			goto exit;
+	adr = vmap(dev->pages, vfb2_num_pages(dev), VM_MAP, PAGE_KERNEL);
+	if (!adr)
+		goto exit;
+
+	dev->videomemory = adr;
+	dev->info->screen_base = adr;
+	/* user space may still map the zero page for pages that were never
+	 * written, make it fault in the real pages */
+	if (dev->mapping)
+		unmap_mapping_range(dev->mapping, 0, 0, 1);
+	ret = 0;
+exit:
+	return ret;
+}
+
+static int vfb2_map_vmem(struct vfb2_device *dev)
+{
+	int ret;
+
+	if (!dev->pages)
+		return 0;
+
+	mutex_lock(&dev->vmem_mutex);
+	ret = __vfb2_map_vmem(dev);
+	mutex_unlock(&dev->vmem_mutex);
+	return ret;
+}
+
+static int vfb2_open(struct fb_info *info, int user)
+{
+	struct vfb2_device *dev = vfb2_get_present_dev(info);
+
+	if (!dev)
+		return -ENODEV;
+	/* the console draws directly into screen_base */
+	if (!user && vfb2_map_vmem(dev))
+		return -ENOMEM;
+	kref_get(&dev->ref);
+	return 0;
+}
+
+static int vfb2_release(struct fb_info *info, int user)
+{
+	struct vfb2_device *dev = vfb2_get_dev(info);
+
+	if (!dev)
+		return -ENODEV;
+	vfb2_put_dev(dev);
+	return 0;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,16)
+static int vfb2_ioctl(struct inode *inode, struct file *file,
+		      unsigned int cmd, unsigned long arg,
+		      struct fb_info *info)
+#else
+static int vfb2_ioctl(struct fb_info *info, unsigned int cmd,
+		      unsigned long arg)
+#endif
+{
+	struct vfb2_device *dev = vfb2_get_present_dev(info);
+	int ret = -ENODEV;
+	ktime_t start;
+	s64 ns;
+
+	if (!dev)
+		return -ENODEV;
+
+	start = ktime_get();
+	down_read(&dev->ioctl_sem);
+	if (dev->present == VFB2_NOT_PRESENT)
+		goto error;
+
+	if (dev->init.vfb2_ioctl)
+		ret = dev->init.vfb2_ioctl(cmd, arg,
+					   dev->table_index);
+	else
+		ret = -ENOIOCTLCMD;
+error:
+	up_read(&dev->ioctl_sem);
+
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	vfb2_count(dev, ioctl, 1);
+	vfb2_count(dev, ioctl_ns, ns);
+	trace_vfb2_ioctl(dev->table_index, cmd, ret, ns);
+	return ret;
+}
+
+/* live mappings prevent resizing of the video memory */
+static void vfb2_vm_open(struct vm_area_struct *vma)
+{
+	struct vfb2_device *dev = vma->vm_private_data;
+
+	atomic_inc(&dev->mmap_count);
+}
+
+static void vfb2_vm_close(struct vm_area_struct *vma)
+{
+	struct vfb2_device *dev = vma->vm_private_data;
+
+	atomic_dec(&dev->mmap_count);
+}
+
+static struct vm_operations_struct vfb2_vm_remap_ops = {
+	.open		= vfb2_vm_open,
+	.close		= vfb2_vm_close,
+};
+
+#ifdef VFB2_HAVE_DEFIO
+static int vfb2_vm_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct vfb2_device *dev = vma->vm_private_data;
+	unsigned long offset = vmf->pgoff << PAGE_SHIFT;
+	struct page *page;
+
+	if (offset >= dev->info->fix.smem_len)
+		return VM_FAULT_SIGBUS;
+
+	vfb2_count(dev, fault, 1);
+	trace_vfb2_fault(dev->table_index, vmf->pgoff,
+			 !!(vmf->flags & FAULT_FLAG_WRITE));
+	/* a shared mapping that may be written gets the real page right
+	 * away, so page_mkwrite and page_mkclean never see the zero page */
+	if ((vmf->flags & FAULT_FLAG_WRITE) ||
+	    ((vma->vm_flags & (VM_SHARED | VM_MAYWRITE)) ==
+	     (VM_SHARED | VM_MAYWRITE))) {
+		page = vfb2_vmem_get_page(dev, vmf->pgoff, GFP_HIGHUSER);
+		if (!page)
+			return VM_FAULT_OOM;
+	} else {
+		page = vfb2_vmem_page(dev, vmf->pgoff);
+		/* a lazy page that was never written reads as zeros in a
+		 * read-only or private mapping */
+		if (!page) {
+			get_page(ZERO_PAGE(0));
+			vmf->page = ZERO_PAGE(0);
+			return 0;
+		}
+	}
+
+	get_page(page);
+	/* page_mkclean needs to find the mappings of the page */
+	if (vma->vm_file)
+		page->mapping = vma->vm_file->f_mapping;
+	page->index = vmf->pgoff;
+	vmf->page = page;
+	return 0;
+}
+
+static int vfb2_vm_page_mkwrite(struct vm_area_struct *vma,
+				struct vm_fault *vmf)
+{
+	struct vfb2_device *dev = vma->vm_private_data;
+	struct page *page = vmf->page;
+
+	/* the page lock orders us against write protection in
+	 * vfb2_get_dirty_pages */
+	lock_page(page);
+	vfb2_count(dev, write_fault, 1);
+	/* the snapshots keep what was there before */
+	vfb2_cow_page_locked(dev, page->index);
+	if (dev->dirty_pages)
+		vfb2_set_dirty(dev, page->index);
+	/* the write itself comes after the fault, a snapshot that already
+	 * started sees the count change */
+	atomic_inc(&dev->band_seq[((unsigned long)page->index << PAGE_SHIFT) /
+				  vfb2_band_size(dev)]);
+	atomic_inc(&dev->frame_seq);
+	vfb2_signal_event(dev, VFB2_EVENT_DIRTY);
+	return VM_FAULT_LOCKED;
+}
+
+static struct vm_operations_struct vfb2_vm_ops = {
+	.open		= vfb2_vm_open,
+	.close		= vfb2_vm_close,
+	.fault		= vfb2_vm_fault,
+	.page_mkwrite	= vfb2_vm_page_mkwrite,
+};
+#endif /* VFB2_HAVE_DEFIO */
+
+#ifdef VFB2_HAVE_CONTIG
+/* one remap per chunk instead of one per page */
+static int vfb2_remap_contig(struct vfb2_device *dev,
+			     struct vm_area_struct *vma)
+{
+	unsigned long chunk_pages = 1UL << dev->contig->order;
+	unsigned long start = vma->vm_start;
+	unsigned long pgoff = vma->vm_pgoff;
+	unsigned long len;
+
+	while (start < vma->vm_end) {
+		len = min((chunk_pages - (pgoff & (chunk_pages - 1))) <<
+			  PAGE_SHIFT, vma->vm_end - start);
+		if (remap_pfn_range(vma, start,
+				    page_to_pfn(vfb2_vmem_page(dev, pgoff)),
+				    len, vma->vm_page_prot))
+			return -EAGAIN;
+		start += len;
+		pgoff += len >> PAGE_SHIFT;
+	}
+	return 0;
+}
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,16)
+static int vfb2_mmap(struct fb_info *info, struct file *file,
+		     struct vm_area_struct *vma)
+#else
+static int vfb2_mmap(struct fb_info *info, struct vm_area_struct *vma)
+# endif
+{
+#ifndef VFB2_HAVE_VMALLOC_USER
 	unsigned long page, pos;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,10)
 	unsigned long kva;
 #endif
 	unsigned long start = vma->vm_start;
+#endif
 	unsigned long size  = vma->vm_end-vma->vm_start;
+	unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
 	struct vfb2_device *dev = vfb2_get_present_dev(info);
+	int ret = -EINVAL;
 
 	if (!dev)
 		return -ENODEV;
 
-	if (size > info->fix.smem_len)
-		return -EINVAL;
+	mutex_lock(&dev->vmem_mutex);
+	if ((offset > info->fix.smem_len) ||
+	    (size > info->fix.smem_len - offset))
+		goto exit;
+
+	vma->vm_private_data = dev;
+	ret = 0;
+#ifdef VFB2_HAVE_DEFIO
+	if (dev->init.flags & (VFB2_FLAG_DEFIO | VFB2_FLAG_LAZY_VMEM)) {
+		/* pages are inserted by vfb2_vm_fault and stay write
+		 * protected until they are written to */
+		vma->vm_ops = &vfb2_vm_ops;
+		vma->vm_flags |= VM_DONTEXPAND | VM_RESERVED;
+		dev->mapping = vma->vm_file->f_mapping;
+		goto exit;
+	}
+#endif
 
-	pos = (unsigned long) info->screen_base;
+	vma->vm_ops = &vfb2_vm_remap_ops;
+#ifdef VFB2_HAVE_CONTIG
+	if (dev->contig) {
+		ret = vfb2_remap_contig(dev, vma);
+		goto exit;
+	}
+#endif
+#ifdef VFB2_HAVE_VMALLOC_USER
+	if (remap_vmalloc_range(vma, info->screen_base, vma->vm_pgoff))
+		ret = -EAGAIN;
+#else
+	pos = (unsigned long) info->screen_base + offset;
 	while (size > 0) {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,10)
 		page = page_to_pfn(vmalloc_to_page((void *)pos));
-		if (remap_pfn_range(vma, start, page, PAGE_SIZE, PAGE_SHARED))
-			return -EAGAIN;
+		if (remap_pfn_range(vma, start, page, PAGE_SIZE, PAGE_SHARED)) {
+			ret = -EAGAIN;
+			goto exit;
+		}
 #else
 		kva = (unsigned long)page_address(vmalloc_to_page((void *)pos));
 		kva |= pos & (PAGE_SIZE-1);
 		page = __pa(kva);
-		if (remap_page_range(vma, start, page, PAGE_SIZE, PAGE_SHARED))
-			return -EAGAIN;
+		if (remap_page_range(vma, start, page, PAGE_SIZE, PAGE_SHARED)) {
+			ret = -EAGAIN;
+			goto exit;
+		}
 #endif
 
 		start += PAGE_SIZE;
@@ -434,312 +1420,2511 @@ static int vfb2_mmap(struct fb_info *info, struct vm_area_struct *vma)
 		else
 			size = 0;
 	}
+#endif
+
+exit:
+	/* mmap does not call vm_ops->open */
+	if (!ret) {
+		vfb2_vm_open(vma);
+		vfb2_count(dev, mmap, 1);
+	}
+	mutex_unlock(&dev->vmem_mutex);
+	return ret;
+}
+
+/* The video memory is system ram, so the drawing functions below work on
+ * whole pixels and rows instead of the bit-shifting io-memory helpers.
+ * They return -1 for what they do not handle, the caller falls back to
+ * the cfb_* functions then. */
+
+static inline u32 vfb2_pixel(struct fb_info *info, u32 color)
+{
+	if ((info->fix.visual == FB_VISUAL_TRUECOLOR) ||
+	    (info->fix.visual == FB_VISUAL_DIRECTCOLOR))
+		return ((u32 *)info->pseudo_palette)[color];
+	return color;
+}
+
+/* n pixels of color at dst */
+static inline void vfb2_fill_pixels(u8 *dst, u32 bpp, u32 color, u32 n)
+{
+	u32 i;
+
+	switch (bpp) {
+	case 8:
+		memset(dst, color, n);
+		break;
+	case 16:
+		for (i=0; i<n; i++)
+			((u16 *)dst)[i] = color;
+		break;
+	case 24:
+		for (i=0; i<n; i++, dst+=3) {
+			dst[0] = color;
+			dst[1] = color >> 8;
+			dst[2] = color >> 16;
+		}
+		break;
+	case 32:
+		for (i=0; i<n; i++)
+			((u32 *)dst)[i] = color;
+		break;
+	}
+}
+
+static int vfb2_sys_fillrect(struct fb_info *info,
+			     const struct fb_fillrect *rect)
+{
+	u32 bpp = info->var.bits_per_pixel;
+	u32 width, height, len, y;
+	u8 *row;
+
+	if ((rect->rop != ROP_COPY) || (bpp < 8))
+		return -1;
+	if ((rect->dx >= info->var.xres_virtual) ||
+	    (rect->dy >= info->var.yres_virtual))
+		return 0;
+	width = min(rect->width, info->var.xres_virtual - rect->dx);
+	height = min(rect->height, info->var.yres_virtual - rect->dy);
+	if (!width || !height)
+		return 0;
+
+	/* the first row is filled pixel by pixel, the others are copies */
+	row = (u8 *)info->screen_base + rect->dy * info->fix.line_length +
+	      rect->dx * (bpp >> 3);
+	len = width * (bpp >> 3);
+	vfb2_fill_pixels(row, bpp, vfb2_pixel(info, rect->color), width);
+	for (y=1; y<height; y++)
+		memcpy(row + y * info->fix.line_length, row, len);
+	return 0;
+}
+
+static int vfb2_sys_copyarea(struct fb_info *info,
+			     const struct fb_copyarea *area)
+{
+	u32 bpp = info->var.bits_per_pixel;
+	u32 line_length = info->fix.line_length;
+	u32 xres = info->var.xres_virtual, yres = info->var.yres_virtual;
+	u32 width, height, len, y;
+	u8 *src, *dst;
+
+	if (bpp < 8)
+		return -1;
+	if ((area->dx >= xres) || (area->dy >= yres) ||
+	    (area->sx >= xres) || (area->sy >= yres))
+		return 0;
+	width = min(area->width, min(xres - area->dx, xres - area->sx));
+	height = min(area->height, min(yres - area->dy, yres - area->sy));
+	if (!width || !height)
+		return 0;
+
+	len = width * (bpp >> 3);
+	src = (u8 *)info->screen_base + area->sy * line_length +
+	      area->sx * (bpp >> 3);
+	dst = (u8 *)info->screen_base + area->dy * line_length +
+	      area->dx * (bpp >> 3);
+	/* rows overlap when scrolling, copy them in the right order,
+	 * memmove handles the overlap within a row */
+	if (area->dy > area->sy) {
+		for (y=height; y-- > 0; )
+			memmove(dst + y * line_length, src + y * line_length,
+				len);
+	} else {
+		for (y=0; y<height; y++)
+			memmove(dst + y * line_length, src + y * line_length,
+				len);
+	}
+	return 0;
+}
+
+/* monochrome images, like the console font */
+static int vfb2_sys_imageblit(struct fb_info *info,
+			      const struct fb_image *image)
+{
+	u32 bpp = info->var.bits_per_pixel;
+	u32 pitch = (image->width + 7) >> 3;
+	u32 fg, bg, width, height, x, y;
+	const u8 *bits;
+	u8 *row, *dst;
+
+	if ((image->depth != 1) || (bpp < 8))
+		return -1;
+	if ((image->dx >= info->var.xres_virtual) ||
+	    (image->dy >= info->var.yres_virtual))
+		return 0;
+	width = min(image->width, info->var.xres_virtual - image->dx);
+	height = min(image->height, info->var.yres_virtual - image->dy);
+
+	fg = vfb2_pixel(info, image->fg_color);
+	bg = vfb2_pixel(info, image->bg_color);
+	row = (u8 *)info->screen_base + image->dy * info->fix.line_length +
+	      image->dx * (bpp >> 3);
+#define VFB2_BIT(x)	(bits[(x) >> 3] & (0x80 >> ((x) & 7)))
+	for (y=0; y<height; y++, row += info->fix.line_length) {
+		bits = (const u8 *)image->data + y * pitch;
+		switch (bpp) {
+		case 8:
+			for (x=0; x<width; x++)
+				row[x] = VFB2_BIT(x) ? fg : bg;
+			break;
+		case 16:
+			for (x=0; x<width; x++)
+				((u16 *)row)[x] = VFB2_BIT(x) ? fg : bg;
+			break;
+		case 24:
+			for (x=0, dst=row; x<width; x++, dst+=3)
+				vfb2_fill_pixels(dst, 24,
+						 VFB2_BIT(x) ? fg : bg, 1);
+			break;
+		case 32:
+			for (x=0; x<width; x++)
+				((u32 *)row)[x] = VFB2_BIT(x) ? fg : bg;
+			break;
+		}
+	}
+#undef VFB2_BIT
+	return 0;
+}
+
+static void vfb2_fillrect(struct fb_info *info,
+			  const struct fb_fillrect *rect)
+{
+	struct vfb2_device *dev = info->par;
+	unsigned long start, end;
+
+	if (!dev || !info->screen_base)
+		return;
+	vfb2_rect_range(info, rect->dx, rect->dy, rect->width, rect->height,
+			&start, &end);
+	vfb2_cow_range(dev, start, end);
+	vfb2_write_begin(dev, start, end);
+	if (vfb2_sys_fillrect(info, rect))
+		cfb_fillrect(info, rect);
+	vfb2_write_end(dev, start, end);
+	vfb2_count(dev, fillrect, 1);
+	vfb2_count(dev, fillrect_pixels, rect->width * rect->height);
+	trace_vfb2_fillrect(dev->table_index, rect->dx, rect->dy,
+			    rect->width, rect->height);
+	vfb2_add_damage(dev, rect->dx, rect->dy,
+			rect->width, rect->height);
+}
+
+static void vfb2_copyarea(struct fb_info *info,
+			  const struct fb_copyarea *area)
+{
+	struct vfb2_device *dev = info->par;
+	unsigned long start, end;
+
+	if (!dev || !info->screen_base)
+		return;
+	vfb2_rect_range(info, area->dx, area->dy, area->width, area->height,
+			&start, &end);
+	vfb2_cow_range(dev, start, end);
+	vfb2_write_begin(dev, start, end);
+	if (vfb2_sys_copyarea(info, area))
+		cfb_copyarea(info, area);
+	vfb2_write_end(dev, start, end);
+	vfb2_count(dev, copyarea, 1);
+	vfb2_count(dev, copyarea_pixels, area->width * area->height);
+	trace_vfb2_copyarea(dev->table_index, area->dx, area->dy,
+			    area->width, area->height);
+	vfb2_add_damage(dev, area->dx, area->dy,
+			area->width, area->height);
+}
+
+static void vfb2_imageblit(struct fb_info *info, const struct fb_image *image)
+{
+	struct vfb2_device *dev = info->par;
+	unsigned long start, end;
+
+	if (!dev || !info->screen_base)
+		return;
+	vfb2_rect_range(info, image->dx, image->dy, image->width,
+			image->height, &start, &end);
+	vfb2_cow_range(dev, start, end);
+	vfb2_write_begin(dev, start, end);
+	if (vfb2_sys_imageblit(info, image))
+		cfb_imageblit(info, image);
+	vfb2_write_end(dev, start, end);
+	vfb2_count(dev, imageblit, 1);
+	vfb2_count(dev, imageblit_pixels, image->width * image->height);
+	trace_vfb2_imageblit(dev->table_index, image->dx, image->dy,
+			     image->width, image->height);
+	vfb2_add_damage(dev, image->dx, image->dy,
+			image->width, image->height);
+}
+
+/* with VFB2_FLAG_CURSOR the cursor is only stored, otherwise the error
+ * makes the console draw it into the frame buffer */
+static int vfb2_cursor(struct fb_info *info, struct fb_cursor *cursor)
+{
+	struct vfb2_device *dev = vfb2_get_present_dev(info);
+	struct fb_image *image = &cursor->image;
+	struct vfb2_cursor *c;
+	unsigned long flags;
+	u32 len;
+
+	if (!dev)
+		return -ENODEV;
+	if (!(dev->init.flags & VFB2_FLAG_CURSOR))
+		return -ENXIO;
+	if ((image->width > VFB2_CURSOR_MAX) ||
+	    (image->height > VFB2_CURSOR_MAX) || (image->depth != 1))
+		return -ENXIO;
+
+	c = &dev->cursor;
+	spin_lock_irqsave(&dev->cursor_lock, flags);
+	c->enable = cursor->enable;
+	if (cursor->set & FB_CUR_SETPOS) {
+		c->x = image->dx;
+		c->y = image->dy;
+	}
+	if (cursor->set & FB_CUR_SETHOT) {
+		c->hot_x = cursor->hot.x;
+		c->hot_y = cursor->hot.y;
+	}
+	if (cursor->set & FB_CUR_SETCMAP) {
+		c->fg = vfb2_pixel(info, image->fg_color);
+		c->bg = vfb2_pixel(info, image->bg_color);
+	}
+	if (cursor->set & (FB_CUR_SETIMAGE | FB_CUR_SETSHAPE |
+			   FB_CUR_SETSIZE)) {
+		c->width = image->width;
+		c->height = image->height;
+		c->rop = cursor->rop;
+		len = ((image->width + 7) >> 3) * image->height;
+		if (image->data)
+			memcpy(c->image, image->data, len);
+		if (cursor->mask)
+			memcpy(c->mask, cursor->mask, len);
+		else
+			memset(c->mask, 0xff, len);
+		c->serial++;
+	}
+	spin_unlock_irqrestore(&dev->cursor_lock, flags);
+
+	vfb2_signal_event(dev, VFB2_EVENT_CURSOR);
+	return 0;
+}
+
+/* the damage of a write() to the bytes from start up to end */
+static void vfb2_add_write_damage(struct vfb2_device *dev,
+				  unsigned long start, unsigned long end)
+{
+	struct fb_info *info = dev->info;
+	u32 line_length = info->fix.line_length;
+	u32 bpp = info->var.bits_per_pixel;
+	u32 x, y, width, height;
+
+	if (!line_length || !bpp || (end <= start))
+		return;
+
+	y = start / line_length;
+	height = (end - 1) / line_length - y + 1;
+	if (height == 1) {
+		x = (start % line_length) * 8 / bpp;
+		width = ((end - 1) % line_length) * 8 / bpp + 1 - x;
+	} else {
+		/* whole lines, a write is mostly a stream of them anyway */
+		x = 0;
+		width = info->var.xres_virtual;
+	}
+	vfb2_add_damage(dev, x, y, width, height);
+}
+
+/* Read and write copy from the kernel mapping of the video memory in large
+ * chunks. Lazy pages that are not mapped into the kernel yet go page by
+ * page. */
+static ssize_t vfb2_read(struct fb_info *info, char __user *buf,
+			 size_t count, loff_t *ppos)
+{
+	struct vfb2_device *dev = vfb2_get_present_dev(info);
+	unsigned long p = *ppos;
+	unsigned long offset, len;
+	struct page *page;
+	void *adr, *vmem;
+	ssize_t ret = 0;
+
+	if (!dev)
+		return -ENODEV;
+	/* keeps the size and the memory */
+	down_read(&dev->rw_sem);
+	if (p >= info->fix.smem_len)
+		goto exit;
+	count = min_t(unsigned long, count, info->fix.smem_len - p);
+
+	vmem = ACCESS_ONCE(dev->videomemory);
+	while (count) {
+		if (vmem) {
+			len = min_t(unsigned long, count, VFB2_RW_CHUNK);
+			len -= copy_to_user(buf, vmem + p, len);
+		} else {
+			offset = p & ~PAGE_MASK;
+			len = min_t(unsigned long, count, PAGE_SIZE - offset);
+			page = vfb2_vmem_page(dev, p >> PAGE_SHIFT);
+			if (page) {
+				adr = kmap(page);
+				len -= copy_to_user(buf, adr + offset, len);
+				kunmap(page);
+			} else
+				len -= clear_user(buf, len);
+		}
+		if (!len) {
+			if (!ret)
+				ret = -EFAULT;
+			break;
+		}
+		buf += len;
+		p += len;
+		count -= len;
+		ret += len;
+		cond_resched();
+	}
+
+	*ppos = p;
+exit:
+	up_read(&dev->rw_sem);
+	return ret;
+}
+
+static ssize_t vfb2_write(struct fb_info *info, const char __user *buf,
+			  size_t count, loff_t *ppos)
+{
+	struct vfb2_device *dev = vfb2_get_present_dev(info);
+	unsigned long start = *ppos, p = *ppos;
+	unsigned long end, offset, len, i;
+	struct page *page;
+	void *adr, *vmem;
+	ssize_t ret = 0;
+
+	if (!dev)
+		return -ENODEV;
+	down_read(&dev->rw_sem);
+	if (p >= info->fix.smem_len) {
+		ret = -EFBIG;
+		goto unlock;
+	}
+	count = min_t(unsigned long, count, info->fix.smem_len - p);
+
+	end = start + count;
+	/* the page lock waits for snapshot faults that still hand out the
+	 * page, a page that is not allocated yet is in no snapshot */
+	if (!list_empty(&dev->cows)) {
+		for (i = start >> PAGE_SHIFT; i <= (end - 1) >> PAGE_SHIFT; i++) {
+			page = vfb2_vmem_page(dev, i);
+			if (!page)
+				continue;
+			lock_page(page);
+			vfb2_cow_page_locked(dev, i);
+			unlock_page(page);
+		}
+	}
+	vfb2_write_begin(dev, start, end);
+	vmem = ACCESS_ONCE(dev->videomemory);
+	while (count) {
+		if (vmem) {
+			len = min_t(unsigned long, count, VFB2_RW_CHUNK);
+			len -= copy_from_user(vmem + p, buf, len);
+		} else {
+			offset = p & ~PAGE_MASK;
+			len = min_t(unsigned long, count, PAGE_SIZE - offset);
+			page = vfb2_vmem_get_page(dev, p >> PAGE_SHIFT,
+						  GFP_HIGHUSER);
+			if (!page) {
+				if (!ret)
+					ret = -ENOMEM;
+				break;
+			}
+			adr = kmap(page);
+			len -= copy_from_user(adr + offset, buf, len);
+			kunmap(page);
+		}
+		if (!len) {
+			if (!ret)
+				ret = -EFAULT;
+			break;
+		}
+		buf += len;
+		p += len;
+		count -= len;
+		ret += len;
+		cond_resched();
+	}
+	vfb2_write_end(dev, start, end);
+
+	if (p == start)
+		goto exit;
+	vfb2_add_write_damage(dev, start, p);
+	/* mmap clients without damage tracking see the pages instead */
+	if (dev->dirty_pages && !(dev->init.flags & VFB2_FLAG_DAMAGE)) {
+		for (i = start >> PAGE_SHIFT; i <= (p - 1) >> PAGE_SHIFT; i++)
+			vfb2_set_dirty(dev, i);
+		vfb2_signal_event(dev, VFB2_EVENT_DIRTY);
+	}
+exit:
+	*ppos = p;
+unlock:
+	up_read(&dev->rw_sem);
+	return ret;
+}
+
+static struct fb_ops vfb2_ops = {
+	.owner		= THIS_MODULE,
+	.fb_setcolreg	= vfb2_setcolreg,
+	.fb_setcmap	= vfb2_setcmap,
+	.fb_check_var	= vfb2_check_var,
+	.fb_set_par	= vfb2_set_par,
+	.fb_pan_display	= vfb2_pan_display,
+	.fb_fillrect	= vfb2_fillrect,
+	.fb_copyarea	= vfb2_copyarea,
+	.fb_imageblit	= vfb2_imageblit,
+	.fb_cursor	= vfb2_cursor,
+	.fb_open	= vfb2_open,
+	.fb_release	= vfb2_release,
+	.fb_read	= vfb2_read,
+	.fb_write	= vfb2_write,
+	.fb_mmap	= vfb2_mmap,
+	.fb_ioctl	= vfb2_ioctl,
+};
+
+static void *vfb2_vmalloc(unsigned long size)
+{
+	void *videomemory;
+#ifndef VFB2_HAVE_VMALLOC_USER
+	void *adr;
+#endif
+
+#ifdef VFB2_HAVE_VMALLOC_USER
+	/* already zeroed */
+	videomemory = vmalloc_user(size);
+#else
+	videomemory = vmalloc(size);
+	if (!videomemory)
+		return NULL;
+
+	memset(videomemory, 0, size);
+	for (adr = videomemory; adr < videomemory + size; adr += PAGE_SIZE)
+		SetPageReserved(vmalloc_to_page(adr));
+#endif
+
+	return videomemory;
+}
+
+static void vfb2_vfree(void *videomemory, unsigned long size)
+{
+	void *adr;
+
+	for (adr = videomemory; adr < videomemory + size; adr += PAGE_SIZE) {
+		/* set by vfb2_vm_fault */
+		vmalloc_to_page(adr)->mapping = NULL;
+#ifndef VFB2_HAVE_VMALLOC_USER
+		ClearPageReserved(vmalloc_to_page(adr));
+#endif
+	}
+	vfree(videomemory);
+}
+
+#ifdef VFB2_HAVE_CONTIG
+static void vfb2_contig_free(struct vfb2_contig *contig)
+{
+	unsigned long i;
+	struct page *page;
+
+	if (contig->mapped)
+		vunmap(contig->vaddr);
+	for (i=0; i<contig->num_pages; i++) {
+		page = contig->chunk[i >> contig->order];
+		/* a failed allocation stops at the first missing chunk */
+		if (!page)
+			break;
+		page += i & ((1UL << contig->order) - 1);
+		/* set by vfb2_vm_fault */
+		page->mapping = NULL;
+		__free_page(page);
+	}
+	kfree(contig);
+}
+
+static struct vfb2_contig *__vfb2_contig_alloc(unsigned long size,
+					       unsigned int order)
+{
+	struct vfb2_contig *contig;
+	struct page **pages;
+	unsigned long i, j, n, num_pages = size >> PAGE_SHIFT;
+	unsigned long num_chunks = (num_pages + (1UL << order) - 1) >> order;
+	unsigned int chunk_order;
+	gfp_t gfp = GFP_KERNEL | __GFP_ZERO;
+
+	/* the next lower order is tried instead */
+	if (order)
+		gfp |= __GFP_NOWARN | __GFP_NORETRY;
+
+	contig = kzalloc(sizeof(struct vfb2_contig) +
+			 num_chunks * sizeof(struct page *), GFP_KERNEL);
+	if (!contig)
+		return NULL;
+	contig->order = order;
+	contig->num_pages = num_pages;
+
+	for (i=0; i<num_chunks; i++) {
+		/* the last chunk only as large as needed */
+		n = min(num_pages - (i << order), 1UL << order);
+		chunk_order = get_order(n << PAGE_SHIFT);
+		contig->chunk[i] = alloc_pages(gfp, chunk_order);
+		if (!contig->chunk[i])
+			goto error;
+		split_page(contig->chunk[i], chunk_order);
+		for (j=n; j<(1UL << chunk_order); j++)
+			__free_page(contig->chunk[i] + j);
+	}
+
+	if (num_chunks == 1) {
+		/* a single chunk needs no vmap, use the linear mapping */
+		contig->vaddr = page_address(contig->chunk[0]);
+		return contig;
+	}
+
+	pages = kmalloc(num_pages * sizeof(struct page *), GFP_KERNEL);
+	if (!pages)
+		goto error;
+	for (i=0; i<num_pages; i++)
+		pages[i] = contig->chunk[i >> order] +
+			   (i & ((1UL << order) - 1));
+	contig->vaddr = vmap(pages, num_pages, VM_MAP, PAGE_KERNEL);
+	kfree(pages);
+	if (!contig->vaddr)
+		goto error;
+	contig->mapped = 1;
+	return contig;
+
+error:
+	vfb2_contig_free(contig);
+	return NULL;
+}
+
+/* tries the largest chunks first, down to single pages */
+static struct vfb2_contig *vfb2_contig_alloc(unsigned long size)
+{
+	struct vfb2_contig *contig;
+	int order;
+
+	for (order = min_t(int, get_order(size), MAX_ORDER - 1); order >= 0;
+	     order--) {
+		contig = __vfb2_contig_alloc(size, order);
+		if (contig)
+			return contig;
+	}
+	return NULL;
+}
+#else
+static inline void vfb2_contig_free(struct vfb2_contig *contig)
+{
+}
+
+static inline struct vfb2_contig *vfb2_contig_alloc(unsigned long size)
+{
+	return NULL;
+}
+#endif
+
+static inline void vfb2_free_lazy_pages(struct vfb2_device *dev,
+					unsigned long first)
+{
+	unsigned long i;
+
+	for (i=first; i<(dev->init.vmem_len >> PAGE_SHIFT); i++)
+		if (dev->pages[i]) {
+			dev->pages[i]->mapping = NULL;
+			__free_page(dev->pages[i]);
+			dev->pages[i] = NULL;
+		}
+}
+
+static inline int vfb2_alloc_vmem(struct vfb2_device *dev)
+{
+	unsigned long size = PAGE_ALIGN(dev->init.vmem_len);
+
+	dev->init.vmem_len = size;
+
+	/* sized for the maximum, so that they survive a resize */
+	if (dev->init.flags & VFB2_FLAG_DEFIO) {
+		dev->dirty_pages = kzalloc(BITS_TO_LONGS(size >> PAGE_SHIFT) *
+					   sizeof(unsigned long), GFP_KERNEL);
+		if (!dev->dirty_pages)
+			return -ENOMEM;
+	}
+
+	if (dev->init.flags & VFB2_FLAG_LAZY_VMEM) {
+		/* no memory until the pages are used */
+		dev->pages = kzalloc((size >> PAGE_SHIFT) *
+				     sizeof(struct page *), GFP_KERNEL);
+		if (!dev->pages)
+			return -ENOMEM;
+	}
+
+	if (dev->init.flags & VFB2_FLAG_SHADOW) {
+		/* starts out equal to the zeroed video memory */
+		dev->shadow = vmalloc(size);
+		if (!dev->shadow)
+			return -ENOMEM;
+		memset(dev->shadow, 0x00, size);
+	}
+
+	/* allocated by vfb2_set_par_helper for the first mode */
+	if (dev->init.flags & VFB2_FLAG_RESIZE_VMEM)
+		return 0;
+
+	if (dev->init.flags & VFB2_FLAG_CONTIG) {
+		dev->contig = vfb2_contig_alloc(size);
+		if (!dev->contig)
+			return -ENOMEM;
+		dev->videomemory = dev->contig->vaddr;
+	} else if (!dev->pages) {
+		dev->videomemory = vfb2_vmalloc(size);
+		if (!dev->videomemory)
+			return -ENOMEM;
+	}
+	dev->vmem_len = size;
+
+	return 0;
+}
+
+static inline void vfb2_free_vmem(struct vfb2_device *dev)
+{
+	if (dev->shadow) {
+		vfree(dev->shadow);
+		dev->shadow = NULL;
+	}
+
+	if (dev->dirty_pages) {
+		kfree(dev->dirty_pages);
+		dev->dirty_pages = NULL;
+	}
+
+	if (dev->pages) {
+		if (dev->videomemory)
+			vunmap(dev->videomemory);
+		vfb2_free_lazy_pages(dev, 0);
+		kfree(dev->pages);
+		dev->pages = NULL;
+	} else if (dev->contig) {
+		vfb2_contig_free(dev->contig);
+		dev->contig = NULL;
+	} else if (dev->videomemory)
+		vfb2_vfree(dev->videomemory, dev->vmem_len);
+
+	dev->videomemory = NULL;
+	dev->vmem_len = 0;
+}
+
+/* Called with vmem_mutex held. Mapped memory is not touched, it is kept if
+ * it is large enough. In-kernel users have to fetch vfb2_videomemory again
+ * after VFB2_EVENT_MODE. */
+static int vfb2_resize_vmem(struct vfb2_device *dev, unsigned long size)
+{
+	struct fb_info *info = dev->info;
+	struct vfb2_client *client;
+	struct vfb2_contig *contig = NULL;
+	void *adr;
+	int mapped;
+	int ret = 0;
+
+	size = PAGE_ALIGN(size);
+	if (size == dev->vmem_len)
+		return 0;
+	if (atomic_read(&dev->mmap_count))
+		return (size <= dev->vmem_len) ? 0 : -EBUSY;
+
+	if (dev->pages) {
+		mapped = (dev->videomemory != NULL);
+		if (mapped) {
+			vunmap(dev->videomemory);
+			dev->videomemory = NULL;
+			info->screen_base = NULL;
+		}
+		vfb2_free_lazy_pages(dev, size >> PAGE_SHIFT);
+		if (dev->shadow && (size < dev->vmem_len))
+			memset(dev->shadow + size, 0x00, dev->vmem_len - size);
+		dev->vmem_len = size;
+		if (mapped)
+			ret = __vfb2_map_vmem(dev);
+	} else {
+		if (dev->init.flags & VFB2_FLAG_CONTIG) {
+			contig = vfb2_contig_alloc(size);
+			if (!contig)
+				return -ENOMEM;
+			adr = contig->vaddr;
+		} else {
+			adr = vfb2_vmalloc(size);
+			if (!adr)
+				return -ENOMEM;
+		}
+		if (dev->contig)
+			vfb2_contig_free(dev->contig);
+		else if (dev->videomemory)
+			vfb2_vfree(dev->videomemory, dev->vmem_len);
+		if (dev->shadow)
+			memset(dev->shadow, 0x00, dev->vmem_len);
+		dev->contig = contig;
+		dev->videomemory = adr;
+		dev->vmem_len = size;
+		info->screen_base = adr;
+	}
+
+	info->fix.smem_len = size;
+	if (dev->dirty_pages)
+		bitmap_zero(dev->dirty_pages, dev->init.vmem_len >> PAGE_SHIFT);
+	spin_lock_irq(&dev->client_lock);
+	list_for_each_entry(client, &dev->clients, list)
+		if (client->dirty_pages)
+			bitmap_zero(client->dirty_pages,
+				    dev->init.vmem_len >> PAGE_SHIFT);
+	spin_unlock_irq(&dev->client_lock);
+	return ret;
+}
+
+/* sets *more if not all pages fit into the array */
+static int __vfb2_take_dirty_pages(struct vfb2_device *dev,
+				   unsigned long *dirty_pages, __u32 *pages,
+				   int count, int *more)
+{
+	struct page *page;
+	unsigned long i, num_pages;
+	int ret = 0;
+
+	num_pages = vfb2_num_pages(dev);
+	for (i = find_first_bit(dirty_pages, num_pages);
+	     (i < num_pages) && (ret < count);
+	     i = find_next_bit(dirty_pages, num_pages, i + 1)) {
+		page = vfb2_vmem_page(dev, i);
+		lock_page(page);
+		clear_bit(i, dirty_pages);
+		/* the next write faults again and sets the bits of all
+		 * consumers */
+		page_mkclean(page);
+		unlock_page(page);
+		pages[ret++] = i;
+	}
+	*more = (i < num_pages);
+	return ret;
+}
+
+static int vfb2_take_dirty_pages(struct vfb2_device *dev, __u32 *pages,
+				 int count)
+{
+	int ret, more;
+
+	mutex_lock(&dev->dirty_lock);
+	vfb2_fetch_events(dev, VFB2_EVENT_DIRTY);
+	ret = __vfb2_take_dirty_pages(dev, dev->dirty_pages, pages, count,
+				      &more);
+	/* some pages are left for the next call */
+	if (more)
+		vfb2_signal_event(dev, VFB2_EVENT_DIRTY);
+	mutex_unlock(&dev->dirty_lock);
+
+	vfb2_count(dev, harvested_bytes, (u64)ret * PAGE_SIZE);
+	trace_vfb2_harvest(dev->table_index, 0, ret, (u64)ret * PAGE_SIZE);
+	return ret;
+}
+
+/* a span header costs this much, shorter equal runs are sent as well */
+#define VFB2_DELTA_GAP		sizeof(struct vfb2_delta_span)
+#define VFB2_DELTA_BATCH	64
+
+struct vfb2_delta_state {
+	struct vfb2_device *dev;
+	u8 *buf;
+	u32 size;
+	u32 used;
+	u32 spans;
+};
+
+/* returns the number of equal bytes at the start */
+static unsigned long vfb2_equal_bytes(const u8 *a, const u8 *b,
+				      unsigned long len)
+{
+	unsigned long i = 0;
+
+	/* both are at the same offset in equally aligned buffers */
+	while ((i < len) && ((unsigned long)(a + i) % sizeof(long))) {
+		if (a[i] != b[i])
+			return i;
+		i++;
+	}
+	while ((i + sizeof(long) <= len) &&
+	       (*(const unsigned long *)(a + i) ==
+		*(const unsigned long *)(b + i)))
+		i += sizeof(long);
+	while ((i < len) && (a[i] == b[i]))
+		i++;
+	return i;
+}
+
+static unsigned long vfb2_diff_bytes(const u8 *a, const u8 *b,
+				     unsigned long len)
+{
+	unsigned long i = 0;
+
+	while ((i < len) && (a[i] != b[i]))
+		i++;
+	return i;
+}
+
+static int vfb2_delta_emit(struct vfb2_delta_state *st, unsigned long offset,
+			   unsigned long len)
+{
+	struct vfb2_delta_span *span;
+	u8 *data;
+
+	if (sizeof(struct vfb2_delta_span) + ALIGN(len, 4) >
+	    st->size - st->used)
+		return -ENOSPC;
+
+	span = (struct vfb2_delta_span *)(st->buf + st->used);
+	span->offset = offset;
+	span->length = len;
+	data = (u8 *)(span + 1);
+	memcpy(data, st->dev->videomemory + offset, len);
+	/* the shadow has to match what the client got, even if the video
+	 * memory changed in between */
+	memcpy(st->dev->shadow + offset, data, len);
+	memset(data + len, 0x00, ALIGN(len, 4) - len);
+
+	st->used += sizeof(struct vfb2_delta_span) + ALIGN(len, 4);
+	st->spans++;
+	return 0;
+}
+
+static int vfb2_delta_range(struct vfb2_delta_state *st, unsigned long offset,
+			    unsigned long len)
+{
+	const u8 *vmem = st->dev->videomemory + offset;
+	const u8 *shadow = st->dev->shadow + offset;
+	unsigned long pos = 0, start, eq;
+	int ret;
+
+	if (offset >= st->dev->vmem_len)
+		return 0;
+	len = min(len, st->dev->vmem_len - offset);
+
+	while (pos < len) {
+		pos += vfb2_equal_bytes(vmem + pos, shadow + pos, len - pos);
+		if (pos == len)
+			break;
+		start = pos;
+		for (;;) {
+			pos += vfb2_diff_bytes(vmem + pos, shadow + pos,
+					       len - pos);
+			eq = vfb2_equal_bytes(vmem + pos, shadow + pos,
+					      len - pos);
+			if ((eq >= VFB2_DELTA_GAP) || (pos + eq == len))
+				break;
+			pos += eq;
+		}
+		ret = vfb2_delta_emit(st, offset + start, pos - start);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int vfb2_delta_rect(struct vfb2_delta_state *st, struct vfb2_rect *r)
+{
+	struct fb_info *info = st->dev->info;
+	u32 bpp = info->var.bits_per_pixel;
+	unsigned long start = ((unsigned long)r->x * bpp) >> 3;
+	unsigned long end = ((unsigned long)(r->x + r->width) * bpp + 7) >> 3;
+	unsigned long line;
+	int ret;
+
+	for (line=r->y; line<r->y+r->height; line++) {
+		ret = vfb2_delta_range(st, line * info->fix.line_length + start,
+				       end - start);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* called with vmem_mutex held */
+static int __vfb2_get_delta(struct vfb2_delta_state *st)
+{
+	struct vfb2_device *dev = st->dev;
+	struct vfb2_damage damage;
+	__u32 pages[VFB2_DELTA_BATCH];
+	unsigned int i;
+	int count;
+	int ret;
+
+	vfb2_take_damage(dev, &damage);
+	for (i=0; i<damage.count; i++) {
+		ret = vfb2_delta_rect(st, &damage.rect[i]);
+		if (ret)
+			return ret;
+	}
+
+	if (!dev->dirty_pages)
+		return 0;
+	do {
+		count = vfb2_take_dirty_pages(dev, pages, VFB2_DELTA_BATCH);
+		for (i=0; i<count; i++) {
+			ret = vfb2_delta_range(st,
+					(unsigned long)pages[i] << PAGE_SHIFT,
+					PAGE_SIZE);
+			if (ret)
+				return ret;
+		}
+	} while (count == VFB2_DELTA_BATCH);
+	return 0;
+}
+
+static void vfb2_free_tiles(struct vfb2_tile_state *st)
+{
+	vfree(st->hash);
+	vfree(st->changed);
+	st->hash = NULL;
+	st->changed = NULL;
+}
+
+#ifdef VFB2_HAVE_TILES
+struct vfb2_tile_work {
+	struct work_struct work;
+	struct vfb2_tile_state *st;
+	const u8 *vmem;
+	/* every step-th row of tiles, starting at first */
+	u32 first;
+	u32 step;
+	u32 changed;
+};
+
+#define VFB2_HASH_PRIME		0x100000001b3ULL
+
+/* one step of the tile hash: the multiplication only carries a changed
+ * bit upwards, the rotation brings the high bits back down, so changes
+ * in several words do not cancel in bit 63 */
+static inline u64 vfb2_hash_step(u64 h, u64 w)
+{
+	h ^= w;
+	return ((h << 27) | (h >> 37)) * VFB2_HASH_PRIME;
+}
+
+/* FNV-1a like over 64 bit words, with a rotation in every step. Every
+ * step is a bijection, so a tile that differs in a single word always
+ * gets a different hash. */
+static u64 vfb2_hash_tile(const u8 *p, u32 line_length, u32 bytes,
+			  u32 lines)
+{
+	u64 h = 0xcbf29ce484222325ULL;
+	u32 i, y;
+
+	for (y=0; y<lines; y++, p += line_length) {
+		for (i=0; i+8<=bytes; i+=8)
+			h = vfb2_hash_step(h,
+				get_unaligned((const u64 *)(p + i)));
+		for (; i<bytes; i++)
+			h = vfb2_hash_step(h, p[i]);
+	}
+	return h;
+}
+
+static void vfb2_tile_work(struct work_struct *work)
+{
+	struct vfb2_tile_work *w = container_of(work, struct vfb2_tile_work,
+						work);
+	struct vfb2_tile_state *st = w->st;
+	u32 row, col, i, width, lines;
+	const u8 *p;
+	u64 h;
+
+	for (row = w->first; row < st->rows; row += w->step) {
+		lines = min_t(u32, VFB2_TILE_SIZE,
+			      st->yres - row * VFB2_TILE_SIZE);
+		p = w->vmem + (unsigned long)row * VFB2_TILE_SIZE *
+			      st->line_length;
+		for (col=0; col<st->columns; col++) {
+			width = min_t(u32, VFB2_TILE_SIZE,
+				      st->xres - col * VFB2_TILE_SIZE);
+			h = vfb2_hash_tile(p + col * VFB2_TILE_SIZE *
+					   st->bpp / 8, st->line_length,
+					   (width * st->bpp + 7) / 8, lines);
+			i = row * st->columns + col;
+			st->changed[i] = (h != st->hash[i]);
+			st->hash[i] = h;
+			w->changed += st->changed[i];
+		}
+	}
+}
+
+/* rehashes the virtual screen, one share of the rows of tiles per cpu,
+ * called with st->lock and vmem_mutex held */
+static int vfb2_rehash_tiles(struct vfb2_device *dev,
+			     struct vfb2_tile_state *st,
+			     struct vfb2_tiles *tiles, u8 *bitmap)
+{
+	struct fb_info *info = dev->info;
+	struct vfb2_tile_work *works;
+	u32 xres = info->var.xres_virtual;
+	u32 yres = info->var.yres_virtual;
+	u32 columns = DIV_ROUND_UP(xres, VFB2_TILE_SIZE);
+	u32 rows = DIV_ROUND_UP(yres, VFB2_TILE_SIZE);
+	u32 i, num = columns * rows, changed = 0;
+	int fresh = 0, n, scheduled, cpu;
+
+	tiles->columns = columns;
+	tiles->rows = rows;
+	if (tiles->size < DIV_ROUND_UP(num, 8)) {
+		tiles->size = DIV_ROUND_UP(num, 8);
+		return -ENOSPC;
+	}
+	tiles->size = DIV_ROUND_UP(num, 8);
+
+	if (!st->hash || (st->xres != xres) || (st->yres != yres) ||
+	    (st->line_length != info->fix.line_length) ||
+	    (st->bpp != info->var.bits_per_pixel)) {
+		vfb2_free_tiles(st);
+		st->hash = vmalloc(num * sizeof(u64));
+		st->changed = vmalloc(num);
+		if (!st->hash || !st->changed) {
+			vfb2_free_tiles(st);
+			return -ENOMEM;
+		}
+		st->columns = columns;
+		st->rows = rows;
+		st->xres = xres;
+		st->yres = yres;
+		st->line_length = info->fix.line_length;
+		st->bpp = info->var.bits_per_pixel;
+		/* nothing to compare with */
+		fresh = 1;
+	}
+
+	n = min_t(int, num_online_cpus(), rows);
+	works = kzalloc(n * sizeof(struct vfb2_tile_work), GFP_KERNEL);
+	if (!works)
+		return -ENOMEM;
+	for (i=0; i<n; i++) {
+		INIT_WORK(&works[i].work, vfb2_tile_work);
+		works[i].st = st;
+		works[i].vmem = dev->videomemory;
+		works[i].first = i;
+		works[i].step = n;
+	}
+
+	/* the first share is done here, shares without a cpu as well */
+	get_online_cpus();
+	scheduled = 1;
+	for_each_online_cpu(cpu) {
+		if (scheduled == n)
+			break;
+		schedule_work_on(cpu, &works[scheduled++].work);
+	}
+	for (i=scheduled; i<n; i++)
+		vfb2_tile_work(&works[i].work);
+	vfb2_tile_work(&works[0].work);
+	for (i=1; i<scheduled; i++)
+		flush_work(&works[i].work);
+	put_online_cpus();
+
+	for (i=0; i<n; i++)
+		changed += works[i].changed;
+	kfree(works);
+
+	if (fresh) {
+		memset(st->changed, 1, num);
+		changed = num;
+	}
+	memset(bitmap, 0x00, tiles->size);
+	for (i=0; i<num; i++)
+		if (st->changed[i])
+			bitmap[i >> 3] |= 1 << (i & 7);
+	tiles->changed = changed;
+	return 0;
+}
+
+static int __vfb2_get_tiles(struct vfb2_device *dev,
+			    struct vfb2_tile_state *st,
+			    struct vfb2_tiles *tiles, u8 *bitmap)
+{
+	int ret;
+
+	mutex_lock(&st->lock);
+	mutex_lock(&dev->vmem_mutex);
+	ret = __vfb2_map_vmem(dev);
+	if (!ret)
+		ret = vfb2_rehash_tiles(dev, st, tiles, bitmap);
+	mutex_unlock(&dev->vmem_mutex);
+	mutex_unlock(&st->lock);
+	return ret;
+}
+#else
+static inline int __vfb2_get_tiles(struct vfb2_device *dev,
+				   struct vfb2_tile_state *st,
+				   struct vfb2_tiles *tiles, u8 *bitmap)
+{
+	return -EOPNOTSUPP;
+}
+#endif /* VFB2_HAVE_TILES */
+
+static int vfb2_sprint_stats(struct vfb2_device *dev, char *buf, int size)
+{
+	struct vfb2_stats *stats = &dev->stats;
+	u64 ioctls = vfb2_counter_read(&stats->ioctl);
+
+#define VFB2_STAT(counter) \
+	(unsigned long long)vfb2_counter_read(&stats->counter)
+	return snprintf(buf, size,
+			"fillrect: %llu calls, %llu pixels\n"
+			"copyarea: %llu calls, %llu pixels\n"
+			"imageblit: %llu calls, %llu pixels\n"
+			"mmap: %llu, faults: %llu, write faults: %llu\n"
+			"mode switches: %llu\n"
+			"ioctl: %llu calls, %llu ns average\n"
+			"damage: %llu bytes produced, %llu bytes harvested\n"
+			"delta: %llu bytes\n"
+			"cow: %llu pages copied\n",
+			VFB2_STAT(fillrect), VFB2_STAT(fillrect_pixels),
+			VFB2_STAT(copyarea), VFB2_STAT(copyarea_pixels),
+			VFB2_STAT(imageblit), VFB2_STAT(imageblit_pixels),
+			VFB2_STAT(mmap), VFB2_STAT(fault),
+			VFB2_STAT(write_fault), VFB2_STAT(mode_switch),
+			(unsigned long long)ioctls,
+			ioctls ? (unsigned long long)
+				 div64_u64(VFB2_STAT(ioctl_ns), ioctls) : 0ULL,
+			VFB2_STAT(damage_bytes), VFB2_STAT(harvested_bytes),
+			VFB2_STAT(delta_bytes), VFB2_STAT(cow_pages));
+#undef VFB2_STAT
+}
+
+/* the file is removed in vfb2_remove, before the device is freed */
+static int vfb2_debugfs_show(struct seq_file *m, void *v)
+{
+	struct vfb2_device *dev = m->private;
+	char *page = (char *)__get_free_page(GFP_KERNEL);
+
+	if (!page)
+		return -ENOMEM;
+
+	vfb2_sprint_stats(dev, page, PAGE_SIZE);
+	seq_puts(m, page);
+
+	free_page((unsigned long)page);
+	return 0;
+}
+
+static int vfb2_debugfs_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, vfb2_debugfs_show, inode->i_private);
+}
+
+static const struct file_operations vfb2_debugfs_fops = {
+	.owner		= THIS_MODULE,
+	.open		= vfb2_debugfs_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* vfb2/bench compares the drawing functions with the cfb_* helpers on a
+ * scratch frame buffer, in ns per call */
+#define VFB2_BENCH_XRES		1024
+#define VFB2_BENCH_YRES		768
+
+static struct fb_ops vfb2_bench_ops = {
+	.owner		= THIS_MODULE,
+};
+
+#define VFB2_BENCH(n, call)						\
+	({								\
+		ktime_t start = ktime_get();				\
+		for (i=0; i<(n); i++)					\
+			call;						\
+		div_s64(ktime_to_ns(ktime_sub(ktime_get(), start)), (n)); \
+	})
+
+static void vfb2_bench_bpp(struct seq_file *m, struct fb_info *info, u32 bpp)
+{
+	static const u8 glyph[16] = { 0x00, 0x00, 0x10, 0x38, 0x6c, 0xc6,
+				      0xc6, 0xfe, 0xc6, 0xc6, 0xc6, 0xc6,
+				      0x00, 0x00, 0x00, 0x00 };
+	struct fb_fillrect rect = { .width = 8, .height = 16, .color = 7,
+				    .rop = ROP_COPY };
+	struct fb_image image = { .width = 8, .height = 16, .fg_color = 7,
+				  .bg_color = 0, .depth = 1,
+				  .data = (const char *)glyph };
+	struct fb_copyarea area = { .dx = 0, .dy = 0, .sx = 0, .sy = 16,
+				    .width = VFB2_BENCH_XRES,
+				    .height = VFB2_BENCH_YRES - 16 };
+	s64 cfb, sys;
+	int i;
+
+	info->var.bits_per_pixel = bpp;
+	info->fix.line_length = VFB2_BENCH_XRES * (bpp >> 3);
+
+#define VFB2_BENCH_POS(r, i)						\
+	do {								\
+		(r).dx = ((i) % (VFB2_BENCH_XRES / 8)) * 8;		\
+		(r).dy = (((i) / (VFB2_BENCH_XRES / 8)) %		\
+			  (VFB2_BENCH_YRES / 16)) * 16;			\
+	} while (0)
+
+	cfb = VFB2_BENCH(10000, ({ VFB2_BENCH_POS(rect, i);
+				   cfb_fillrect(info, &rect); }));
+	sys = VFB2_BENCH(10000, ({ VFB2_BENCH_POS(rect, i);
+				   vfb2_sys_fillrect(info, &rect); }));
+	seq_printf(m, "%2ubpp fillrect 8x16   cfb %8lld  vfb2 %8lld\n", bpp,
+		   (long long)cfb, (long long)sys);
+
+	cfb = VFB2_BENCH(10000, ({ VFB2_BENCH_POS(image, i);
+				   cfb_imageblit(info, &image); }));
+	sys = VFB2_BENCH(10000, ({ VFB2_BENCH_POS(image, i);
+				   vfb2_sys_imageblit(info, &image); }));
+	seq_printf(m, "%2ubpp imageblit 8x16  cfb %8lld  vfb2 %8lld\n", bpp,
+		   (long long)cfb, (long long)sys);
+#undef VFB2_BENCH_POS
+
+	cfb = VFB2_BENCH(20, cfb_copyarea(info, &area));
+	sys = VFB2_BENCH(20, vfb2_sys_copyarea(info, &area));
+	seq_printf(m, "%2ubpp scroll          cfb %8lld  vfb2 %8lld\n", bpp,
+		   (long long)cfb, (long long)sys);
+}
+
+static int vfb2_bench_show(struct seq_file *m, void *v)
+{
+	struct fb_info *info;
+	int i;
+
+	info = framebuffer_alloc(sizeof(u32) * 16, NULL);
+	if (!info)
+		return -ENOMEM;
+	info->screen_base = vmalloc(VFB2_BENCH_XRES * VFB2_BENCH_YRES * 4);
+	if (!info->screen_base) {
+		framebuffer_release(info);
+		return -ENOMEM;
+	}
+	memset(info->screen_base, 0x00,
+	       VFB2_BENCH_XRES * VFB2_BENCH_YRES * 4);
+
+	info->pseudo_palette = info->par;
+	for (i=0; i<16; i++)
+		((u32 *)info->pseudo_palette)[i] = i * 0x111111;
+	info->fbops = &vfb2_bench_ops;
+	info->fix.visual = FB_VISUAL_TRUECOLOR;
+	info->var.xres = info->var.xres_virtual = VFB2_BENCH_XRES;
+	info->var.yres = info->var.yres_virtual = VFB2_BENCH_YRES;
+
+	vfb2_bench_bpp(m, info, 16);
+	vfb2_bench_bpp(m, info, 24);
+	vfb2_bench_bpp(m, info, 32);
+
+	vfree(info->screen_base);
+	framebuffer_release(info);
+	return 0;
+}
+#undef VFB2_BENCH
+
+static int vfb2_bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, vfb2_bench_show, NULL);
+}
+
+static const struct file_operations vfb2_bench_fops = {
+	.owner		= THIS_MODULE,
+	.open		= vfb2_bench_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* called when the last reference is gone, or if vfb2_register fails
+ * before the device is in the table */
+static void vfb2_remove(struct vfb2_device *dev)
+{
+	if (!dev)
+		return;
+
+	if (dev->debugfs)
+		debugfs_remove(dev->debugfs);
+
+	if (dev->info) {
+		if (dev->present != VFB2_ERROR_ON_REGISTER)
+			unregister_framebuffer(dev->info);
+		dev->info->par = NULL;
+
+		if (dev->info->cmap.len)
+			fb_dealloc_cmap(&dev->info->cmap);
+
+		framebuffer_release(dev->info);
+		dev->info = NULL;
+	}
+
+	vfb2_free_vmem(dev);
+	vfb2_free_tiles(&dev->tiles);
+
+	kfree(dev->mode_index);
+	kfree(dev->mode_info);
+	if (dev->init.mode_table)
+		kfree(dev->init.mode_table);
+	kfree(dev);
+}
+
+static inline int vfb2_num_modes(struct vfb2_mode *mode_table)
+{
+	int i;
+
+	for (i=0; mode_table[i].xres; i++) ;
+	return i;
+}
+
+static int vfb2_mode_key_sort(const void *a, const void *b)
+{
+	const struct vfb2_mode_key *ka = a, *kb = b;
+	int ret = vfb2_mode_key_cmp(ka, kb->xres, kb->yres, kb->bpp);
+
+	if (ret)
+		return ret;
+	return (ka->index < kb->index) ? -1 : (ka->index > kb->index);
+}
+
+/* checks the mode table and builds the index for vfb2_match_mode */
+static int vfb2_build_mode_index(struct vfb2_device *dev)
+{
+	struct vfb2_mode *mode;
+	struct vfb2_mode_info *mi;
+	struct vfb2_mode_key *key;
+	struct fb_var_screeninfo var;
+	u32 first;
+	int i, j, k;
+
+	if (!dev->num_modes)
+		return -EINVAL;
+	for (i=0; i<dev->num_modes; i++) {
+		mode = &dev->init.mode_table[i];
+		if (!mode->yres)
+			return -EINVAL;
+		switch (mode->bpp) {
+		case 1:
+		case 8:
+		case 16:
+		case 24:
+		case 32:
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	dev->mode_index = kmalloc(dev->num_modes *
+				  sizeof(struct vfb2_mode_key), GFP_KERNEL);
+	dev->mode_info = kmalloc(dev->num_modes *
+				 sizeof(struct vfb2_mode_info), GFP_KERNEL);
+	if (!dev->mode_index || !dev->mode_info)
+		return -ENOMEM;
+
+	for (i=0; i<dev->num_modes; i++) {
+		mode = &dev->init.mode_table[i];
+		key = &dev->mode_index[i];
+		key->xres = mode->xres;
+		key->yres = mode->yres;
+		key->bpp = mode->bpp;
+		key->index = i;
+
+		mi = &dev->mode_info[i];
+		mi->line_length = ((mode->xres * mode->bpp + 7) & ~7) >> 3;
+		memset(&var, 0x00, sizeof(struct fb_var_screeninfo));
+		var.bits_per_pixel = mode->bpp;
+		vfb2_set_bitfields(&var, mode->transp_mode);
+		mi->red = var.red;
+		mi->green = var.green;
+		mi->blue = var.blue;
+		mi->transp = var.transp;
+	}
+
+	sort(dev->mode_index, dev->num_modes, sizeof(struct vfb2_mode_key),
+	     vfb2_mode_key_sort, NULL);
+	key = dev->mode_index;
+	for (i=0; i<dev->num_modes; i=j) {
+		first = key[i].index;
+		for (j=i+1; (j<dev->num_modes) &&
+			    (key[j].xres == key[i].xres) &&
+			    (key[j].yres == key[i].yres); j++)
+			first = min(first, key[j].index);
+		for (k=i; k<j; k++)
+			key[k].first = first;
+	}
+	return 0;
+}
+
+static inline struct vfb2_device *vfb2_init_dev(struct vfb2_init *init)
+{
+	struct vfb2_device *dev;
+	int mtable_size = (vfb2_num_modes(init->mode_table)+1)
+			  * sizeof(struct vfb2_mode);
+	int i;
+
+	dev = kmalloc(sizeof(struct vfb2_device), GFP_KERNEL);
+	if (!dev)
+		goto error;
+	memcpy(&dev->init, init, sizeof(struct vfb2_init));
+
+	dev->init.mode_table = kmalloc(mtable_size, GFP_KERNEL);
+	if (!dev->init.mode_table) {
+		kfree(dev);
+		dev = NULL;
+		goto error;
+	}
+	memcpy(dev->init.mode_table, init->mode_table, mtable_size);
+	dev->num_modes = vfb2_num_modes(init->mode_table);
+	dev->mode_index = NULL;
+	dev->mode_info = NULL;
+
+	dev->info = NULL;
+	dev->videomemory = NULL;
+	dev->vmem_len = 0;
+	atomic_set(&dev->mmap_count, 0);
+	dev->dirty_pages = NULL;
+	dev->pages = NULL;
+	dev->mapping = NULL;
+	spin_lock_init(&dev->vmem_lock);
+	mutex_init(&dev->vmem_mutex);
+	dev->current_mode = 0;
+	dev->yoffset = 0;
+	dev->present = VFB2_ERROR_ON_REGISTER;
+	dev->table_index = -1;
+	kref_init(&dev->ref);
+	init_rwsem(&dev->ioctl_sem);
+	init_rwsem(&dev->rw_sem);
+	spin_lock_init(&dev->damage_lock);
+	mutex_init(&dev->dirty_lock);
+	spin_lock_init(&dev->event_lock);
+	dev->events = 0;
+	init_waitqueue_head(&dev->event_wait);
+	memset(&dev->stats, 0x00, sizeof(struct vfb2_stats));
+	dev->debugfs = NULL;
+	dev->shadow = NULL;
+	INIT_LIST_HEAD(&dev->clients);
+	spin_lock_init(&dev->client_lock);
+	mutex_init(&dev->tiles.lock);
+	for (i=0; i<VFB2_SEQ_BANDS; i++) {
+		atomic_set(&dev->band_writers[i], 0);
+		atomic_set(&dev->band_seq[i], 0);
+	}
+	atomic_set(&dev->frame_seq, 0);
+	INIT_LIST_HEAD(&dev->cows);
+	spin_lock_init(&dev->cow_lock);
+	mutex_init(&dev->cow_mutex);
+	spin_lock_init(&dev->palette_lock);
+	memset(&dev->palette, 0x00, sizeof(struct vfb2_palette));
+	spin_lock_init(&dev->cursor_lock);
+	memset(&dev->cursor, 0x00, sizeof(struct vfb2_cursor));
+	memset(&dev->damage, 0x00, sizeof(struct vfb2_damage));
+error:
+	return dev;
+}
+
+int vfb2_register(struct vfb2_init *init)
+{
+	int i;
+	struct fb_info *info;
+	int res = -ENOMEM;
+	struct vfb2_device *dev;
+	char name[16];
+
+	if (!init || !init->mode_table)
+		return -EINVAL;
+	if (init->flags & ~VFB2_SUPPORTED_FLAGS)
+		return -EINVAL;
+	if ((init->flags & VFB2_FLAG_SHADOW) &&
+	    !(init->flags & VFB2_FLAG_DAMAGE))
+		return -EINVAL;
+	if ((init->flags & VFB2_FLAG_CONTIG) &&
+	    (init->flags & VFB2_FLAG_LAZY_VMEM))
+		return -EINVAL;
+
+	dev = vfb2_init_dev(init);
+	if (!dev)
+		goto error;
+
+	res = vfb2_build_mode_index(dev);
+	if (res)
+		goto error;
+	res = -ENOMEM;
+
+	if (vfb2_alloc_vmem(dev))
+		goto error;
+
+	info = framebuffer_alloc(sizeof(__u32) * 256, NULL);
+	if (!info)
+		goto error;
+	info->pseudo_palette = info->par;
+	info->par = dev;
+	dev->info = info;
+
+	res = fb_alloc_cmap(&info->cmap, 256, 0);
+	if (res < 0)
+		goto error;
+	/* the default colors */
+	for (i=0; i<info->cmap.len; i++)
+		dev->palette.color[i] = ((info->cmap.red[i] >> 8) << 16) |
+					((info->cmap.green[i] >> 8) << 8) |
+					(info->cmap.blue[i] >> 8);
+
+	info->screen_base = dev->videomemory;
+	info->fbops = &vfb2_ops;
+	info->flags = FBINFO_FLAG_DEFAULT;
+	strcpy(info->fix.id, "vfb2");
+	info->fix.type = FB_TYPE_PACKED_PIXELS;
+	info->fix.accel = FB_ACCEL_NONE;
+	info->fix.smem_len = dev->vmem_len;
+	vfb2_set_mode(dev, &info->var, 0);
+	res = vfb2_check_var_helper(&info->var, dev);
+	if (res < 0)
+		goto error;
+	res = vfb2_set_par_helper(info, dev);
+	if (res < 0)
+		goto error;
+
+	spin_lock(&vfb2_table_lock);
+	for (i=0; i<VFB2_MAX_DEVICES; i++)
+		if (vfb2_table[i] == NULL) {
+			dev->table_index = i;
+			rcu_assign_pointer(vfb2_table[i], dev);
+			break;
+		}
+	spin_unlock(&vfb2_table_lock);
+	if (dev->table_index == -1) {
+		err("vfb2_table is full!");
+		res = -EBUSY;
+		goto error;
+	}
+
+	/* the console code calls the fb ops from within
+	 * register_framebuffer */
+	dev->present = VFB2_PRESENT;
+	res = register_framebuffer(info);
+	if (!res) {
+		if (vfb2_debugfs) {
+			snprintf(name, sizeof(name), "fb%d", info->node);
+			dev->debugfs = debugfs_create_file(name, S_IRUSR,
+					vfb2_debugfs, dev,
+					&vfb2_debugfs_fops);
+		}
+		return dev->table_index;
+	}
+
+	dev->present = VFB2_ERROR_ON_REGISTER;
+	spin_lock(&vfb2_table_lock);
+	rcu_assign_pointer(vfb2_table[dev->table_index], NULL);
+	spin_unlock(&vfb2_table_lock);
+	synchronize_rcu();
+	/* a lookup may still hold a reference, the last one removes it */
+	vfb2_put_dev(dev);
+	return res;
+error:
+	/* not published yet */
+	vfb2_remove(dev);
+	return res;
+}
+
+void vfb2_unregister(int table_index)
+{
+	struct vfb2_device *dev = NULL;
+
+	spin_lock(&vfb2_table_lock);
+	if ((table_index >= 0) && (table_index < VFB2_MAX_DEVICES)) {
+		dev = vfb2_table[table_index];
+		rcu_assign_pointer(vfb2_table[table_index], NULL);
+	}
+	spin_unlock(&vfb2_table_lock);
+	if (!dev) {
+		err("vfb2_unregister: invalid table_index");
+		return;
+	}
+	dev->present = VFB2_NOT_PRESENT;
+
+	/* wake up vfb2_wait_event */
+	wake_up_interruptible_all(&dev->event_wait);
+
+	/* wait for ioctl to finish */
+	down_write(&dev->ioctl_sem);
+	up_write(&dev->ioctl_sem);
+
+	synchronize_rcu();
+	vfb2_put_dev(dev);
+}
+
+int vfb2_current_mode(int table_index)
+{
+	struct vfb2_device *dev;
+	int ret = -EINVAL;
+
+	rcu_read_lock();
+	dev = vfb2_index_to_dev(table_index);
+	if (!dev)
+		goto error;
+	ret = dev->current_mode;
+error:
+	rcu_read_unlock();
+	return ret;
+}
+
+/* with VFB2_FLAG_LAZY_VMEM, this allocates all pages, so it may sleep */
+void *vfb2_videomemory(int table_index)
+{
+	struct vfb2_device *dev;
+	void *ret = NULL;
+
+	dev = vfb2_index_get_dev(table_index);
+	if (!dev)
+		return NULL;
+	if (!vfb2_map_vmem(dev))
+		ret = dev->videomemory;
+	vfb2_put_dev(dev);
+	return ret;
+}
+
+struct fb_info *vfb2_fb_info(int table_index)
+{
+	struct vfb2_device *dev;
+	struct fb_info *ret = NULL;
+
+	rcu_read_lock();
+	dev = vfb2_index_to_dev(table_index);
+	if (!dev)
+		goto error;
+	ret = dev->info;
+error:
+	rcu_read_unlock();
+	return ret;
+}
+
+void *vfb2_private(int table_index)
+{
+	struct vfb2_device *dev;
+	void *ret = NULL;
+
+	rcu_read_lock();
+	dev = vfb2_index_to_dev(table_index);
+	if (!dev)
+		goto error;
+	ret = dev->init.private;
+error:
+	rcu_read_unlock();
+	return ret;
+}
+
+int vfb2_get_damage(int table_index, struct vfb2_damage *damage)
+{
+	struct vfb2_device *dev;
+	int ret = -EINVAL;
+
+	rcu_read_lock();
+	dev = vfb2_index_to_dev(table_index);
+	if (!dev)
+		goto error;
+	/* the damage belongs to vfb2_get_delta */
+	if ((dev->init.flags & (VFB2_FLAG_DAMAGE | VFB2_FLAG_SHADOW)) !=
+	    VFB2_FLAG_DAMAGE)
+		goto error;
+
+	vfb2_take_damage(dev, damage);
+	ret = 0;
+error:
+	rcu_read_unlock();
+	return ret;
+}
+
+int vfb2_get_dirty_pages(int table_index, __u32 *pages, int count)
+{
+	struct vfb2_device *dev;
+	int ret = -EINVAL;
+
+	dev = vfb2_index_get_dev(table_index);
+	if (!dev)
+		return -EINVAL;
+	if (!dev->dirty_pages || (dev->init.flags & VFB2_FLAG_SHADOW))
+		goto error;
+
+	ret = vfb2_take_dirty_pages(dev, pages, count);
+error:
+	vfb2_put_dev(dev);
+	return ret;
+}
+
+static void __vfb2_get_front(struct vfb2_device *dev,
+			     struct vfb2_front *front)
+{
+	front->yoffset = dev->yoffset;
+	front->index = front->yoffset / dev->info->var.yres;
+	front->offset = front->yoffset * dev->info->fix.line_length;
+	front->reserved = 0;
+}
+
+int vfb2_get_front(int table_index, struct vfb2_front *front)
+{
+	struct vfb2_device *dev;
+	int ret = -EINVAL;
+
+	rcu_read_lock();
+	dev = vfb2_index_to_dev(table_index);
+	if (!dev)
+		goto error;
+	__vfb2_get_front(dev, front);
+	ret = 0;
+error:
+	rcu_read_unlock();
+	return ret;
+}
+
+/* the caller has to keep the device registered while it is polled */
+unsigned int vfb2_poll(int table_index, struct file *file, poll_table *wait)
+{
+	struct vfb2_device *dev;
+	unsigned int ret = POLLERR;
+
+	rcu_read_lock();
+	dev = vfb2_index_to_dev(table_index);
+	if (!dev)
+		goto error;
+	poll_wait(file, &dev->event_wait, wait);
+	ret = 0;
+	if (dev->present != VFB2_PRESENT)
+		ret |= POLLHUP;
+	if (dev->events)
+		ret |= POLLIN | POLLRDNORM;
+error:
+	rcu_read_unlock();
+	return ret;
+}
+
+/* Waits at most timeout jiffies for an event, returns the VFB2_EVENT_* mask
+ * of the pending events and clears them. Returns 0 on timeout. */
+int vfb2_wait_event(int table_index, long timeout)
+{
+	struct vfb2_device *dev;
+	long res;
+
+	dev = vfb2_index_get_dev(table_index);
+	if (!dev)
+		return -EINVAL;
+
+	if (timeout) {
+		res = wait_event_interruptible_timeout(dev->event_wait,
+				dev->events || (dev->present != VFB2_PRESENT),
+				timeout);
+		if (res < 0)
+			goto error;
+	}
+	res = -ENODEV;
+	if (dev->present != VFB2_PRESENT)
+		goto error;
+
+	res = vfb2_fetch_events(dev, ~0);
+error:
+	vfb2_put_dev(dev);
+	return res;
+}
+
+/* fills buf with the changes since the last call, see struct
+ * vfb2_delta_span, returns the number of bytes used */
+int vfb2_get_delta(int table_index, void *buf, struct vfb2_delta *delta)
+{
+	struct vfb2_device *dev;
+	struct vfb2_delta_state st;
+	struct fb_var_screeninfo *var;
+	struct vfb2_rect r;
+	unsigned long flags;
+	int ret = -EINVAL;
+
+	dev = vfb2_index_get_dev(table_index);
+	if (!dev)
+		return -EINVAL;
+	if (!dev->shadow)
+		goto error;
+
+	st.dev = dev;
+	st.buf = buf;
+	st.size = delta->size;
+	st.used = 0;
+	st.spans = 0;
+	delta->flags = 0;
+
+	mutex_lock(&dev->vmem_mutex);
+	ret = __vfb2_map_vmem(dev);
+	if (!ret)
+		ret = __vfb2_get_delta(&st);
+	mutex_unlock(&dev->vmem_mutex);
+
+	if (ret == -ENOSPC) {
+		/* the shadow still holds what was not sent, so comparing
+		 * the whole screen next time finds exactly the rest. Only
+		 * the owner's damage, the clients and the event are not
+		 * concerned. */
+		var = &dev->info->var;
+		r.x = 0;
+		r.y = 0;
+		r.width = var->xres_virtual;
+		r.height = var->yres_virtual;
+		spin_lock_irqsave(&dev->damage_lock, flags);
+		vfb2_merge_damage(&dev->damage, &r);
+		spin_unlock_irqrestore(&dev->damage_lock, flags);
+		delta->flags |= VFB2_DELTA_TRUNCATED;
+		ret = 0;
+	}
+	if (!ret) {
+		delta->size = st.used;
+		delta->spans = st.spans;
+		vfb2_count(dev, delta_bytes, st.used);
+		ret = st.used;
+	}
+error:
+	vfb2_put_dev(dev);
+	return ret;
+}
+
+/* the table index of the frame buffer with the given node, the fb may be
+ * gone by the time the index is used */
+int vfb2_node_to_index(int node)
+{
+	struct vfb2_device *dev;
+	int i, ret = -ENODEV;
+
+	rcu_read_lock();
+	for (i=0; i<VFB2_MAX_DEVICES; i++) {
+		dev = vfb2_index_to_dev(i);
+		if (dev && (dev->present == VFB2_PRESENT) &&
+		    (dev->info->node == node)) {
+			ret = i;
+			break;
+		}
+	}
+	rcu_read_unlock();
+	return ret;
+}
+
+/* Attaches another consumer to a registered frame buffer. It gets its own
+ * damage, events and dirty pages, notify is called like
+ * vfb2_init.vfb2_notify, but with client_lock held. */
+struct vfb2_client *vfb2_attach(int table_index,
+				void (*notify)(unsigned int events,
+					       void *private),
+				void *private)
+{
+	struct vfb2_device *dev;
+	struct vfb2_client *client;
+	unsigned long flags;
+
+	dev = vfb2_index_get_dev(table_index);
+	if (!dev)
+		return ERR_PTR(-EINVAL);
+	if (dev->present != VFB2_PRESENT) {
+		vfb2_put_dev(dev);
+		return ERR_PTR(-ENODEV);
+	}
+
+	client = kzalloc(sizeof(struct vfb2_client), GFP_KERNEL);
+	if (!client)
+		goto error;
+	if (dev->dirty_pages) {
+		client->dirty_pages = kzalloc(BITS_TO_LONGS(
+				dev->init.vmem_len >> PAGE_SHIFT) *
+				sizeof(unsigned long), GFP_KERNEL);
+		if (!client->dirty_pages)
+			goto error;
+	}
+	/* the client keeps the reference of vfb2_index_get_dev */
+	client->dev = dev;
+	mutex_init(&client->dirty_lock);
+	mutex_init(&client->tiles.lock);
+	client->notify = notify;
+	client->private = private;
+
+	spin_lock_irqsave(&dev->client_lock, flags);
+	list_add_tail(&client->list, &dev->clients);
+	spin_unlock_irqrestore(&dev->client_lock, flags);
+	return client;
+
+error:
+	if (client)
+		kfree(client->dirty_pages);
+	kfree(client);
+	vfb2_put_dev(dev);
+	return ERR_PTR(-ENOMEM);
+}
+
+/* notify is not called any more afterwards */
+void vfb2_detach(struct vfb2_client *client)
+{
+	struct vfb2_device *dev = client->dev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->client_lock, flags);
+	list_del(&client->list);
+	spin_unlock_irqrestore(&dev->client_lock, flags);
+
+	kfree(client->dirty_pages);
+	vfb2_free_tiles(&client->tiles);
+	kfree(client);
+	vfb2_put_dev(dev);
+}
 
-	return 0;
+/* -ENODEV once the frame buffer was unregistered. The index may belong to
+ * another frame buffer after that, so it is only for messages, the
+ * vfb2_client_* calls reach the device through the client. */
+int vfb2_client_index(struct vfb2_client *client)
+{
+	if (client->dev->present != VFB2_PRESENT)
+		return -ENODEV;
+	return client->dev->table_index;
 }
 
-static struct fb_ops vfb2_ops = {
-	.owner		= THIS_MODULE,
-	.fb_setcolreg	= vfb2_setcolreg,
-	.fb_check_var	= vfb2_check_var,
-	.fb_set_par	= vfb2_set_par,
-	.fb_fillrect	= cfb_fillrect,
-	.fb_copyarea	= cfb_copyarea,
-	.fb_imageblit	= cfb_imageblit,
-	/* FIXME: Why did I comment this line? */
-//	.fb_cursor	= soft_cursor,
-	.fb_open	= vfb2_open,
-	.fb_release	= vfb2_release,
-	.fb_mmap	= vfb2_mmap,
-	.fb_ioctl	= vfb2_ioctl,
-};
+int vfb2_client_current_mode(struct vfb2_client *client)
+{
+	if (client->dev->present != VFB2_PRESENT)
+		return -ENODEV;
+	return client->dev->current_mode;
+}
 
-static inline int vfb2_alloc_vmem(struct vfb2_device *dev)
+/* valid as long as the client is attached */
+struct fb_info *vfb2_client_fb_info(struct vfb2_client *client)
 {
-	void *adr;
-	long size = dev->init.vmem_len;
+	if (client->dev->present != VFB2_PRESENT)
+		return NULL;
+	return client->dev->info;
+}
 
-	if (size % PAGE_SIZE) {
-		size = ((size % PAGE_SIZE) + 1) * PAGE_SIZE;
-		dev->init.vmem_len = size;
-	}
+int vfb2_client_get_front(struct vfb2_client *client,
+			  struct vfb2_front *front)
+{
+	if (client->dev->present != VFB2_PRESENT)
+		return -ENODEV;
+	__vfb2_get_front(client->dev, front);
+	return 0;
+}
 
-	if (!(dev->videomemory = vmalloc(size)))
-		return -ENOMEM;
+int vfb2_client_print_stats(struct vfb2_client *client, char *buf,
+			    int size)
+{
+	return vfb2_sprint_stats(client->dev, buf, size);
+}
 
-	memset(dev->videomemory, 0, size);
-	adr = dev->videomemory;
-	while (size > 0) {
-		SetPageReserved(vmalloc_to_page(adr));
-		adr += PAGE_SIZE;
-		size -= PAGE_SIZE;
-	}
+int vfb2_client_get_damage(struct vfb2_client *client,
+			   struct vfb2_damage *damage)
+{
+	struct vfb2_device *dev = client->dev;
+	unsigned long flags;
 
+	if (!(dev->init.flags & VFB2_FLAG_DAMAGE))
+		return -EINVAL;
+
+	spin_lock_irqsave(&dev->client_lock, flags);
+	memcpy(damage, &client->damage, sizeof(struct vfb2_damage));
+	client->damage.count = 0;
+	client->events &= ~VFB2_EVENT_DAMAGE;
+	spin_unlock_irqrestore(&dev->client_lock, flags);
 	return 0;
 }
 
-static inline void vfb2_free_vmem(struct vfb2_device *dev)
+int vfb2_client_get_dirty_pages(struct vfb2_client *client, __u32 *pages,
+				int count)
 {
-	void *adr = dev->videomemory;
-	long size = dev->init.vmem_len;
+	struct vfb2_device *dev = client->dev;
+	unsigned long flags;
+	int ret, more;
 
-	if (!adr)
-		return;
+	if (!client->dirty_pages)
+		return -EINVAL;
 
-	while (size > 0) {
-		ClearPageReserved(vmalloc_to_page(adr));
-		adr += PAGE_SIZE;
-		size -= PAGE_SIZE;
+	mutex_lock(&client->dirty_lock);
+	spin_lock_irqsave(&dev->client_lock, flags);
+	client->events &= ~VFB2_EVENT_DIRTY;
+	spin_unlock_irqrestore(&dev->client_lock, flags);
+	ret = __vfb2_take_dirty_pages(dev, client->dirty_pages, pages, count,
+				      &more);
+	if (more) {
+		spin_lock_irqsave(&dev->client_lock, flags);
+		client->events |= VFB2_EVENT_DIRTY;
+		spin_unlock_irqrestore(&dev->client_lock, flags);
 	}
-	vfree(dev->videomemory);
-	dev->videomemory = NULL;
+	mutex_unlock(&client->dirty_lock);
+	return ret;
 }
 
-static void vfb2_remove(struct vfb2_device *dev)
+unsigned int vfb2_client_poll(struct vfb2_client *client, struct file *file,
+			      poll_table *wait)
 {
-	if (!dev)
-		return;
-
-	down_write(&vfb2_table_sem);
-	if (dev->table_index >= 0) {
-		if (dev->present == VFB2_PRESENT) {
-			err("vfb2_remove called, but device still present!");
-			goto error;
-		}
-		if (atomic_read(&dev->open)) {
-			err("vfb2_remove called, but device still open!");
-			goto error;
-		}
-		if (dev->present != VFB2_ERROR_ON_REGISTER)
-			unregister_framebuffer(dev->info);
+	struct vfb2_device *dev = client->dev;
+	unsigned int ret = 0;
+
+	poll_wait(file, &dev->event_wait, wait);
+	if (dev->present != VFB2_PRESENT)
+		ret |= POLLHUP;
+	if (client->events)
+		ret |= POLLIN | POLLRDNORM;
+	return ret;
+}
 
-		vfb2_table[dev->table_index] = NULL;
-		dev->table_index = -1;
-		dev->info->par = NULL;
+/* like vfb2_wait_event */
+int vfb2_client_wait_event(struct vfb2_client *client, long timeout)
+{
+	struct vfb2_device *dev = client->dev;
+	unsigned long flags;
+	long res;
+
+	if (timeout) {
+		res = wait_event_interruptible_timeout(dev->event_wait,
+				client->events ||
+				(dev->present != VFB2_PRESENT), timeout);
+		if (res < 0)
+			return res;
 	}
-	up_write(&vfb2_table_sem);
+	if (dev->present != VFB2_PRESENT)
+		return -ENODEV;
 
-	if (dev->info) {
-		if (dev->info->cmap.len)
-			fb_dealloc_cmap(&dev->info->cmap);
+	spin_lock_irqsave(&dev->client_lock, flags);
+	res = client->events;
+	client->events = 0;
+	spin_unlock_irqrestore(&dev->client_lock, flags);
+	return res;
+}
 
-		framebuffer_release(dev->info);
-		dev->info = NULL;
-	}
+/* reads the counts of the bands, 0 if one has writers */
+static int vfb2_read_begin(struct vfb2_device *dev, unsigned long first,
+			   unsigned long last, u32 *seq)
+{
+	unsigned long b;
+
+	for (b=first; b<=last; b++)
+		seq[b] = atomic_read(&dev->band_seq[b]);
+	smp_rmb();
+	for (b=first; b<=last; b++)
+		if (atomic_read(&dev->band_writers[b]))
+			return 0;
+	return 1;
+}
 
-	vfb2_free_vmem(dev);
+/* 1 if a band was written since vfb2_read_begin */
+static int vfb2_read_retry(struct vfb2_device *dev, unsigned long first,
+			   unsigned long last, const u32 *seq)
+{
+	unsigned long b;
 
-	if (dev->init.mode_table)
-		kfree(dev->init.mode_table);
-	kfree(dev);
-	return;
-error:
-	up_write(&vfb2_table_sem);
+	smp_rmb();
+	for (b=first; b<=last; b++)
+		if (atomic_read(&dev->band_writers[b]) ||
+		    (seq[b] != atomic_read(&dev->band_seq[b])))
+			return 1;
+	return 0;
 }
 
-static inline int vfb2_num_modes(struct vfb2_mode *mode_table)
+static int __vfb2_snapshot(struct vfb2_device *dev,
+			   struct vfb2_snapshot *snap, void *buf,
+			   unsigned long size)
 {
-	int i;
+	struct vfb2_rect *r = &snap->rect;
+	struct fb_info *info;
+	unsigned long start, end, first, last, line_length;
+	u32 seq[VFB2_SEQ_BANDS];
+	u32 i, bytes, tries, max;
+	int ret = -EINVAL;
 
-	for (i=0; mode_table[i].xres; i++) ;
-	return i;
+	info = dev->info;
+
+	/* keeps the mode and the video memory */
+	mutex_lock(&dev->vmem_mutex);
+	if ((info->var.bits_per_pixel & 7) ||
+	    (r->width > info->var.xres_virtual) ||
+	    (r->x > info->var.xres_virtual - r->width) ||
+	    (r->height > info->var.yres_virtual) ||
+	    (r->y > info->var.yres_virtual - r->height))
+		goto exit;
+	bytes = r->width * (info->var.bits_per_pixel >> 3);
+	if (!vfb2_rect_range(info, r->x, r->y, r->width, r->height, &start,
+			     &end) || ((unsigned long)bytes * r->height > size))
+		goto exit;
+	ret = __vfb2_map_vmem(dev);
+	if (ret)
+		goto exit;
+
+	line_length = info->fix.line_length;
+	first = start / vfb2_band_size(dev);
+	last = (end - 1) / vfb2_band_size(dev);
+	max = snap->retries ? min_t(u32, snap->retries,
+				    VFB2_SNAPSHOT_MAX_RETRIES) :
+			      VFB2_SNAPSHOT_RETRIES;
+	ret = -EAGAIN;
+	for (tries=0; tries<=max; tries++) {
+		if (tries)
+			cond_resched();
+		if (!vfb2_read_begin(dev, first, last, seq))
+			continue;
+		for (i=0; i<r->height; i++)
+			memcpy(buf + i * bytes, dev->videomemory + start +
+			       i * line_length, bytes);
+		if (!vfb2_read_retry(dev, first, last, seq)) {
+			ret = 0;
+			break;
+		}
+	}
+	snap->retries = min(tries, max);
+	snap->seq = atomic_read(&dev->frame_seq);
+	snap->bytes = bytes;
+exit:
+	mutex_unlock(&dev->vmem_mutex);
+	return ret;
 }
 
-static inline struct vfb2_device *vfb2_init_dev(struct vfb2_init *init)
+int vfb2_snapshot(int table_index, struct vfb2_snapshot *snap, void *buf,
+		  unsigned long size)
 {
 	struct vfb2_device *dev;
-	int mtable_size = (vfb2_num_modes(init->mode_table)+1)
-			  * sizeof(struct vfb2_mode);
+	int ret;
 
-	dev = kmalloc(sizeof(struct vfb2_device), GFP_KERNEL);
+	dev = vfb2_index_get_dev(table_index);
 	if (!dev)
-		goto error;
-	memcpy(&dev->init, init, sizeof(struct vfb2_init));
+		return -EINVAL;
+	ret = __vfb2_snapshot(dev, snap, buf, size);
+	vfb2_put_dev(dev);
+	return ret;
+}
 
-	dev->init.mode_table = kmalloc(mtable_size, GFP_KERNEL);
-	if (!dev->init.mode_table) {
-		kfree(dev);
-		dev = NULL;
+int vfb2_client_snapshot(struct vfb2_client *client,
+			 struct vfb2_snapshot *snap, void *buf,
+			 unsigned long size)
+{
+	if (client->dev->present != VFB2_PRESENT)
+		return -ENODEV;
+	return __vfb2_snapshot(client->dev, snap, buf, size);
+}
+
+static void vfb2_cow_release(struct kref *ref)
+{
+	struct vfb2_cow *cow = container_of(ref, struct vfb2_cow, ref);
+	struct vfb2_device *dev = cow->dev;
+	unsigned long flags, i;
+
+	spin_lock_irqsave(&dev->cow_lock, flags);
+	list_del(&cow->list);
+	spin_unlock_irqrestore(&dev->cow_lock, flags);
+	for (i=0; i<cow->num_pages; i++)
+		if (cow->pages[i])
+			put_page(cow->pages[i]);
+	vfree(cow);
+	vfb2_put_dev(dev);
+}
+
+/* the snapshot takes a reference of the device */
+static struct vfb2_cow *__vfb2_cow_create(struct vfb2_device *dev)
+{
+	struct vfb2_cow *cow;
+	struct page *page;
+	unsigned long flags, i, num_pages;
+	int ret = -EINVAL;
+
+	kref_get(&dev->ref);
+	/* writes through an mmap are only seen by their write faults */
+	if (!(dev->init.flags & VFB2_FLAG_DEFIO))
 		goto error;
-	}
-	memcpy(dev->init.mode_table, init->mode_table, mtable_size);
 
-	dev->info = NULL;
-	dev->videomemory = NULL;
-	dev->current_mode = 0;
-	dev->present = VFB2_ERROR_ON_REGISTER;
-	dev->table_index = -1;
-	atomic_set(&dev->open, 0);
-	init_rwsem(&dev->ioctl_sem);
+	/* keeps the pages */
+	mutex_lock(&dev->vmem_mutex);
+	ret = -ENOMEM;
+	num_pages = vfb2_num_pages(dev);
+	cow = vmalloc(sizeof(struct vfb2_cow) +
+		      num_pages * sizeof(struct page *) +
+		      BITS_TO_LONGS(num_pages) * sizeof(unsigned long));
+	if (!cow)
+		goto unlock;
+	kref_init(&cow->ref);
+	cow->dev = dev;
+	cow->broken = 0;
+	cow->mapping = NULL;
+	cow->map_pgoff = 0;
+	cow->map_count = 0;
+	cow->lent = (unsigned long *)&cow->pages[num_pages];
+	bitmap_zero(cow->lent, num_pages);
+	cow->seq = atomic_read(&dev->frame_seq);
+	cow->mode = dev->current_mode;
+	cow->yoffset = dev->yoffset;
+	cow->num_pages = num_pages;
+	for (i=0; i<num_pages; i++) {
+		page = vfb2_vmem_page(dev, i);
+		if (page)
+			get_page(page);
+		cow->pages[i] = page;
+	}
+	spin_lock_irqsave(&dev->cow_lock, flags);
+	list_add(&cow->list, &dev->cows);
+	spin_unlock_irqrestore(&dev->cow_lock, flags);
+
+	/* the next write through a mapping faults and copies the page */
+	for (i=0; i<num_pages; i++) {
+		page = vfb2_vmem_page(dev, i);
+		if (!page)
+			continue;
+		lock_page(page);
+		page_mkclean(page);
+		unlock_page(page);
+	}
+	mutex_unlock(&dev->vmem_mutex);
+	/* the device reference goes with the snapshot */
+	return cow;
+unlock:
+	mutex_unlock(&dev->vmem_mutex);
 error:
-	return dev;
+	vfb2_put_dev(dev);
+	return ERR_PTR(ret);
 }
 
-int vfb2_register(struct vfb2_init *init)
+struct vfb2_cow *vfb2_cow_create(int table_index)
 {
-	int i;
-	struct fb_info *info;
-	int res = -ENOMEM;
 	struct vfb2_device *dev;
+	struct vfb2_cow *cow;
 
-	if (!init || !init->mode_table)
-		return -EINVAL;
-
-	dev = vfb2_init_dev(init);
+	dev = vfb2_index_get_dev(table_index);
 	if (!dev)
-		goto error;
+		return ERR_PTR(-EINVAL);
+	cow = __vfb2_cow_create(dev);
+	vfb2_put_dev(dev);
+	return cow;
+}
 
-	if (vfb2_alloc_vmem(dev))
-		goto error;
+struct vfb2_cow *vfb2_client_cow_create(struct vfb2_client *client)
+{
+	if (client->dev->present != VFB2_PRESENT)
+		return ERR_PTR(-ENODEV);
+	return __vfb2_cow_create(client->dev);
+}
 
-	info = framebuffer_alloc(sizeof(__u32) * 256, NULL);
-	if (!info)
-		goto error;
-	info->pseudo_palette = info->par;
-	info->par = dev;
-	dev->info = info;
+void vfb2_cow_get(struct vfb2_cow *cow)
+{
+	kref_get(&cow->ref);
+}
 
-	res = fb_alloc_cmap(&info->cmap, 256, 0);
-	if (res < 0)
-		goto error;
+void vfb2_cow_put(struct vfb2_cow *cow)
+{
+	kref_put(&cow->ref, vfb2_cow_release);
+}
 
-	info->screen_base = dev->videomemory;
-	info->fbops = &vfb2_ops;
-	info->flags = FBINFO_FLAG_DEFAULT;
-	strcpy(info->fix.id, "vfb2");
-	info->fix.type = FB_TYPE_PACKED_PIXELS;
-	info->fix.accel = FB_ACCEL_NONE;
-	info->fix.smem_len = dev->init.vmem_len;
-	vfb2_set_mode(dev, &info->var, 0);
-	res = vfb2_check_var_helper(&info->var, dev);
-	if (res < 0)
-		goto error;
-	res = vfb2_set_par_helper(info, dev);
-	if (res < 0)
-		goto error;
+/* Returns the page locked and with a reference, NULL for zeros or beyond
+ * the end. A live page is lent out: a write copies it only after the page
+ * lock is dropped and zaps the mapping passed to vfb2_cow_map, so the
+ * caller reads the snapshot until unlock_page. May sleep. */
+struct page *vfb2_cow_get_page(struct vfb2_cow *cow, unsigned long pgoff)
+{
+	struct vfb2_device *dev = cow->dev;
+	struct page *page;
+	unsigned long flags;
 
-	down_write(&vfb2_table_sem);
-	for (i=0; i<VFB2_MAX_DEVICES; i++)
-		if (vfb2_table[i] == NULL) {
-			dev->table_index = i;
-			vfb2_table[i] = dev;
-			break;
-		}
-	if (dev->table_index == -1) {
-		err("vfb2_table is full!");
-		res = -EBUSY;
-		goto error2;
-	}
+	if (pgoff >= cow->num_pages)
+		return NULL;
+again:
+	/* a write may replace it meanwhile */
+	spin_lock_irqsave(&dev->cow_lock, flags);
+	page = cow->pages[pgoff];
+	if (page)
+		get_page(page);
+	spin_unlock_irqrestore(&dev->cow_lock, flags);
+	if (!page)
+		return NULL;
 
-	/* FIXME: do not hold vfb2_table_sem, may lead to deadlock in console
-	 * code. Use kref to sync with vfb2_unregister. */
-	res = register_framebuffer(info);
-	if (!res) {
-		dev->present = VFB2_PRESENT;
-		res = dev->table_index;
+	lock_page(page);
+	spin_lock_irqsave(&dev->cow_lock, flags);
+	if (cow->pages[pgoff] != page) {
+		spin_unlock_irqrestore(&dev->cow_lock, flags);
+		unlock_page(page);
+		put_page(page);
+		goto again;
 	}
-error2:
-	up_write(&vfb2_table_sem);
-error:
-	if (res < 0)
-		vfb2_remove(dev);
-	return res;
+	if (vfb2_cow_shared(dev, cow, pgoff))
+		set_bit(pgoff, cow->lent);
+	spin_unlock_irqrestore(&dev->cow_lock, flags);
+	return page;
 }
 
-static struct vfb2_device *vfb2_index_to_dev(int index)
+/* the pages of the snapshot are mapped at pgoff of mapping, once per vma */
+void vfb2_cow_map(struct vfb2_cow *cow, struct address_space *mapping,
+		  unsigned long pgoff)
 {
-	struct vfb2_device *dev;
+	struct vfb2_device *dev = cow->dev;
+	unsigned long flags;
+
+	mutex_lock(&dev->cow_mutex);
+	spin_lock_irqsave(&dev->cow_lock, flags);
+	cow->mapping = mapping;
+	cow->map_pgoff = pgoff;
+	cow->map_count++;
+	spin_unlock_irqrestore(&dev->cow_lock, flags);
+	mutex_unlock(&dev->cow_mutex);
+}
 
-	if ((index < 0) || (index >= VFB2_MAX_DEVICES))
-		return NULL;
-	dev = vfb2_table[index];
-	return dev;
+void vfb2_cow_unmap(struct vfb2_cow *cow)
+{
+	struct vfb2_device *dev = cow->dev;
+	unsigned long flags;
+
+	mutex_lock(&dev->cow_mutex);
+	spin_lock_irqsave(&dev->cow_lock, flags);
+	if (!--cow->map_count)
+		cow->mapping = NULL;
+	spin_unlock_irqrestore(&dev->cow_lock, flags);
+	mutex_unlock(&dev->cow_mutex);
 }
 
-void vfb2_unregister(int table_index)
+void vfb2_cow_info(struct vfb2_cow *cow, struct vfb2_cow_info *info)
+{
+	memset(info, 0x00, sizeof(struct vfb2_cow_info));
+	info->flags = cow->broken ? VFB2_COW_BROKEN : 0;
+	info->seq = cow->seq;
+	info->mode = cow->mode;
+	info->yoffset = cow->yoffset;
+	info->size = (__u64)cow->num_pages << PAGE_SHIFT;
+}
+
+int vfb2_client_get_tiles(struct vfb2_client *client,
+			  struct vfb2_tiles *tiles, __u8 *bitmap)
+{
+	if (client->dev->present != VFB2_PRESENT)
+		return -ENODEV;
+	return __vfb2_get_tiles(client->dev, &client->tiles, tiles, bitmap);
+}
+
+int vfb2_get_tiles(int table_index, struct vfb2_tiles *tiles, __u8 *bitmap)
 {
 	struct vfb2_device *dev;
-	int open;
+	int ret;
 
-	down_write(&vfb2_table_sem);
-	dev = vfb2_index_to_dev(table_index);
-	if (!dev) {
-		up_write(&vfb2_table_sem);
-		err("vfb2_unregister: invalid table_index");
-		return;
-	}
-	dev->present = VFB2_NOT_PRESENT;
-	open = atomic_read(&dev->open);
-	up_write(&vfb2_table_sem);
+	dev = vfb2_index_get_dev(table_index);
+	if (!dev)
+		return -EINVAL;
+	ret = __vfb2_get_tiles(dev, &dev->tiles, tiles, bitmap);
+	vfb2_put_dev(dev);
+	return ret;
+}
 
-	/* wait for ioctl to finish */
-	down_write(&dev->ioctl_sem);
-	up_write(&dev->ioctl_sem);
+static void __vfb2_get_cursor(struct vfb2_device *dev,
+			      struct vfb2_cursor *cursor)
+{
+	unsigned long flags;
 
-	if (!open)
-		vfb2_remove(dev);
+	spin_lock_irqsave(&dev->cursor_lock, flags);
+	memcpy(cursor, &dev->cursor, sizeof(struct vfb2_cursor));
+	spin_unlock_irqrestore(&dev->cursor_lock, flags);
 }
 
-int vfb2_current_mode(int table_index)
+int vfb2_get_cursor(int table_index, struct vfb2_cursor *cursor)
 {
 	struct vfb2_device *dev;
 	int ret = -EINVAL;
 
-	down_read(&vfb2_table_sem);
+	rcu_read_lock();
 	dev = vfb2_index_to_dev(table_index);
-	if (!dev)
+	if (!dev || !(dev->init.flags & VFB2_FLAG_CURSOR))
 		goto error;
-	ret = dev->current_mode;
+	vfb2_fetch_events(dev, VFB2_EVENT_CURSOR);
+	__vfb2_get_cursor(dev, cursor);
+	ret = 0;
 error:
-	up_read(&vfb2_table_sem);
+	rcu_read_unlock();
 	return ret;
 }
 
-void *vfb2_videomemory(int table_index)
+/* clears the cursor event of the client, not the owner's */
+int vfb2_client_get_cursor(struct vfb2_client *client,
+			   struct vfb2_cursor *cursor)
 {
-	struct vfb2_device *dev;
-	void *ret = NULL;
+	struct vfb2_device *dev = client->dev;
+	unsigned long flags;
 
-	down_read(&vfb2_table_sem);
-	dev = vfb2_index_to_dev(table_index);
-	if (!dev)
-		goto error;
-	ret = dev->videomemory;
-error:
-	up_read(&vfb2_table_sem);
-	return ret;
+	if (dev->present != VFB2_PRESENT)
+		return -ENODEV;
+	if (!(dev->init.flags & VFB2_FLAG_CURSOR))
+		return -EINVAL;
+	spin_lock_irqsave(&dev->client_lock, flags);
+	client->events &= ~VFB2_EVENT_CURSOR;
+	spin_unlock_irqrestore(&dev->client_lock, flags);
+	__vfb2_get_cursor(dev, cursor);
+	return 0;
 }
 
-struct fb_info *vfb2_fb_info(int table_index)
+static void __vfb2_get_palette(struct vfb2_device *dev,
+			       struct vfb2_palette *palette)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->palette_lock, flags);
+	memcpy(palette, &dev->palette, sizeof(struct vfb2_palette));
+	spin_unlock_irqrestore(&dev->palette_lock, flags);
+}
+
+int vfb2_get_palette(int table_index, struct vfb2_palette *palette)
 {
 	struct vfb2_device *dev;
-	struct fb_info *ret = NULL;
+	int ret = -EINVAL;
 
-	down_read(&vfb2_table_sem);
+	rcu_read_lock();
 	dev = vfb2_index_to_dev(table_index);
 	if (!dev)
 		goto error;
-	ret = dev->info;
+	vfb2_fetch_events(dev, VFB2_EVENT_PALETTE);
+	__vfb2_get_palette(dev, palette);
+	ret = 0;
 error:
-	up_read(&vfb2_table_sem);
+	rcu_read_unlock();
 	return ret;
 }
 
-void *vfb2_private(int table_index)
+/* clears the palette event of the client, not the owner's */
+int vfb2_client_get_palette(struct vfb2_client *client,
+			    struct vfb2_palette *palette)
+{
+	struct vfb2_device *dev = client->dev;
+	unsigned long flags;
+
+	if (dev->present != VFB2_PRESENT)
+		return -ENODEV;
+	spin_lock_irqsave(&dev->client_lock, flags);
+	client->events &= ~VFB2_EVENT_PALETTE;
+	spin_unlock_irqrestore(&dev->client_lock, flags);
+	__vfb2_get_palette(dev, palette);
+	return 0;
+}
+
+/* prints the statistics of the device, returns the length */
+int vfb2_print_stats(int table_index, char *buf, int size)
 {
 	struct vfb2_device *dev;
-	void *ret = NULL;
+	int ret = -EINVAL;
 
-	down_read(&vfb2_table_sem);
+	rcu_read_lock();
 	dev = vfb2_index_to_dev(table_index);
-	if (!dev)
-		goto error;
-	ret = dev->init.private;
-error:
-	up_read(&vfb2_table_sem);
+	if (dev)
+		ret = vfb2_sprint_stats(dev, buf, size);
+	rcu_read_unlock();
 	return ret;
 }
 
+static int __init vfb2_module_init(void)
+{
+	vfb2_debugfs = debugfs_create_dir("vfb2", NULL);
+	/* statistics are optional */
+	if (IS_ERR(vfb2_debugfs))
+		vfb2_debugfs = NULL;
+	if (vfb2_debugfs)
+		debugfs_create_file("bench", S_IRUSR, vfb2_debugfs, NULL,
+				    &vfb2_bench_fops);
+	return 0;
+}
+
+static void __exit vfb2_module_exit(void)
+{
+	if (vfb2_debugfs)
+		debugfs_remove_recursive(vfb2_debugfs);
+}
+
+module_init(vfb2_module_init);
+module_exit(vfb2_module_exit);
+
 MODULE_LICENSE ("GPL");
 
 EXPORT_SYMBOL(vfb2_register);
@@ -748,3 +3933,38 @@ EXPORT_SYMBOL(vfb2_current_mode);
 EXPORT_SYMBOL(vfb2_videomemory);
 EXPORT_SYMBOL(vfb2_fb_info);
 EXPORT_SYMBOL(vfb2_private);
+EXPORT_SYMBOL(vfb2_get_damage);
+EXPORT_SYMBOL(vfb2_get_dirty_pages);
+EXPORT_SYMBOL(vfb2_get_front);
+EXPORT_SYMBOL(vfb2_poll);
+EXPORT_SYMBOL(vfb2_wait_event);
+EXPORT_SYMBOL(vfb2_print_stats);
+EXPORT_SYMBOL(vfb2_get_delta);
+EXPORT_SYMBOL(vfb2_get_cursor);
+EXPORT_SYMBOL(vfb2_get_palette);
+EXPORT_SYMBOL(vfb2_node_to_index);
+EXPORT_SYMBOL(vfb2_attach);
+EXPORT_SYMBOL(vfb2_detach);
+EXPORT_SYMBOL(vfb2_client_index);
+EXPORT_SYMBOL(vfb2_client_get_damage);
+EXPORT_SYMBOL(vfb2_client_get_dirty_pages);
+EXPORT_SYMBOL(vfb2_client_poll);
+EXPORT_SYMBOL(vfb2_client_wait_event);
+EXPORT_SYMBOL(vfb2_client_current_mode);
+EXPORT_SYMBOL(vfb2_client_fb_info);
+EXPORT_SYMBOL(vfb2_client_get_front);
+EXPORT_SYMBOL(vfb2_client_get_cursor);
+EXPORT_SYMBOL(vfb2_client_get_palette);
+EXPORT_SYMBOL(vfb2_client_print_stats);
+EXPORT_SYMBOL(vfb2_client_snapshot);
+EXPORT_SYMBOL(vfb2_client_cow_create);
+EXPORT_SYMBOL(vfb2_get_tiles);
+EXPORT_SYMBOL(vfb2_snapshot);
+EXPORT_SYMBOL(vfb2_client_get_tiles);
+EXPORT_SYMBOL(vfb2_cow_create);
+EXPORT_SYMBOL(vfb2_cow_get);
+EXPORT_SYMBOL(vfb2_cow_put);
+EXPORT_SYMBOL(vfb2_cow_get_page);
+EXPORT_SYMBOL(vfb2_cow_map);
+EXPORT_SYMBOL(vfb2_cow_unmap);
+EXPORT_SYMBOL(vfb2_cow_info);
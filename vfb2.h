@@ -8,6 +8,34 @@
 #define VFB2_16BPP_NO_TRANSP	0
 #define VFB2_16BPP_TRANSP	1
 
+/* feature flags for vfb2_init.flags */
+#define VFB2_FLAG_DAMAGE	0x00000001	/* track damaged rectangles */
+#define VFB2_FLAG_DEFIO		0x00000002	/* track pages written via mmap */
+#define VFB2_FLAG_BUFFERING	0x00000004	/* allow yres_virtual > yres */
+#define VFB2_FLAG_LAZY_VMEM	0x00000008	/* allocate pages on first use */
+#define VFB2_FLAG_RESIZE_VMEM	0x00000010	/* vmem_len is only the maximum,
+						 * size follows the video mode */
+#define VFB2_FLAG_SHADOW	0x00000020	/* damage is only returned by
+						 * vfb2_get_delta, needs
+						 * VFB2_FLAG_DAMAGE */
+#define VFB2_FLAG_CURSOR	0x00000040	/* keep the cursor out of the
+						 * frame buffer */
+#define VFB2_FLAG_CONTIG	0x00000080	/* physically contiguous video
+						 * memory, not with
+						 * VFB2_FLAG_LAZY_VMEM */
+
+/* with VFB2_FLAG_BUFFERING, yres_virtual may be up to this times yres */
+#define VFB2_MAX_BUFFERS	3
+
+/* events returned by vfb2_wait_event */
+#define VFB2_EVENT_DAMAGE	0x00000001	/* drawing operation, only with
+						 * VFB2_FLAG_DAMAGE */
+#define VFB2_EVENT_DIRTY	0x00000002	/* write to a mmap'ed page */
+#define VFB2_EVENT_MODE		0x00000004	/* video mode was set */
+#define VFB2_EVENT_PAN		0x00000008	/* front buffer changed */
+#define VFB2_EVENT_CURSOR	0x00000010	/* cursor changed */
+#define VFB2_EVENT_PALETTE	0x00000020	/* palette changed */
+
 struct vfb2_mode {
 	__u32 xres;
 	__u32 yres;
@@ -17,14 +45,167 @@ struct vfb2_mode {
 	__u8 reserved[3];
 };
 
+struct vfb2_rect {
+	__u32 x;
+	__u32 y;
+	__u32 width;
+	__u32 height;
+};
+
+/* if more rectangles are damaged, the closest ones are merged */
+#define VFB2_MAX_DAMAGE_RECTS	8
+
+struct vfb2_damage {
+	__u32 count;
+	__u32 reserved;
+	struct vfb2_rect rect[VFB2_MAX_DAMAGE_RECTS];
+};
+
+/* the visible part of the virtual frame buffer, a complete frame is
+ * available there after VFB2_EVENT_PAN */
+struct vfb2_front {
+	__u32 index;	/* yoffset / yres */
+	__u32 yoffset;	/* first visible line */
+	__u32 offset;	/* offset of the first visible line in bytes */
+	__u32 reserved;
+};
+
+/* vfb2_get_delta fills the buffer with spans of bytes that changed since
+ * the last call, each span header is followed by length bytes of new
+ * contents and padded to 4 bytes */
+struct vfb2_delta_span {
+	__u32 offset;	/* in the video memory */
+	__u32 length;
+};
+
+/* the buffer was too small, the remaining changes are returned by the
+ * next call */
+#define VFB2_DELTA_TRUNCATED	0x00000001
+
+struct vfb2_delta {
+	__u64 buf;	/* user pointer to the span buffer */
+	__u32 size;	/* in: size of the buffer, out: bytes used */
+	__u32 spans;	/* out: number of spans */
+	__u32 flags;	/* out: VFB2_DELTA_* */
+	__u32 reserved;
+};
+
+/* with VFB2_FLAG_CURSOR, the cursor is not drawn into the frame buffer
+ * but kept here for the display to overlay */
+#define VFB2_CURSOR_MAX		64
+
+struct vfb2_cursor {
+	__u32 enable;
+	__u32 x;	/* top left corner of the image */
+	__u32 y;
+	__u32 hot_x;
+	__u32 hot_y;
+	__u32 width;
+	__u32 height;
+	__u32 fg;	/* pixel values in the frame buffer format */
+	__u32 bg;
+	__u32 rop;	/* ROP_COPY or ROP_XOR */
+	__u32 serial;	/* changes when image or mask change */
+	__u32 reserved;
+	/* 1bpp, msb first, rows padded to a byte. Like the soft cursor, the
+	 * image bits are combined with the mask by rop (AND for ROP_COPY),
+	 * set bits show fg and the others bg. */
+	__u8 image[VFB2_CURSOR_MAX * VFB2_CURSOR_MAX / 8];
+	__u8 mask[VFB2_CURSOR_MAX * VFB2_CURSOR_MAX / 8];
+};
+
+/* the pseudocolor palette, one event and one serial per fb_setcmap that
+ * changes it */
+#define VFB2_PALETTE_SIZE	256
+
+struct vfb2_palette {
+	__u32 serial;
+	__u32 reserved;
+	__u32 color[VFB2_PALETTE_SIZE];	/* 0x00rrggbb */
+};
+
+/* vfb2_get_tiles hashes the virtual screen in squares of this many pixels
+ * and reports the ones whose contents changed since the last call, so
+ * writes that store the same pixels again are filtered out */
+#define VFB2_TILE_SIZE		64
+
+struct vfb2_tiles {
+	__u32 columns;	/* out: tiles per line of the virtual screen */
+	__u32 rows;	/* out: lines of tiles */
+	__u32 changed;	/* out: number of changed tiles */
+	__u32 size;	/* in: size of the bitmap in bytes, out: bytes used,
+			 * or needed if it was too small */
+	__u64 bitmap;	/* user pointer, tile n is bit n % 8 of byte n / 8,
+			 * counted row by row from the top left */
+};
+
+/* Copies a rectangle of the virtual screen only if no drawing operation,
+ * write() or write fault touched it during the copy, otherwise it is tried
+ * again. Writes through an mmap are only seen with VFB2_FLAG_DEFIO, by
+ * their first write fault after the pages were harvested. */
+struct vfb2_snapshot {
+	struct vfb2_rect rect;	/* in: inside the virtual screen */
+	__u64 buf;		/* user pointer */
+	__u32 pitch;		/* in: bytes per line of buf */
+	__u32 retries;		/* in: maximum, 0 for the default, out: used */
+	__u32 seq;		/* out: frame sequence number, counts writes */
+	__u32 bytes;		/* out: bytes per line copied */
+};
+
+#define VFB2_SNAPSHOT_RETRIES		16
+#define VFB2_SNAPSHOT_MAX_RETRIES	1024
+
+/* A frame frozen by vfb2_cow_create. Pages written afterwards are copied
+ * before the write, so the snapshot costs only the pages that changed. A
+ * mapping of the snapshot reads the live page until then and is zapped
+ * when it is copied. The drawing ops can not zap, a mapped page they write
+ * sets VFB2_COW_BROKEN instead.
+ * Needs VFB2_FLAG_DEFIO, writes through an mmap are caught by their
+ * write faults. */
+struct vfb2_cow_info {
+	__u32 flags;	/* VFB2_COW_* */
+	__u32 seq;	/* frame sequence number when it was taken */
+	__u32 mode;	/* mode and pan offset when it was taken */
+	__u32 yoffset;
+	__u64 size;	/* bytes of video memory */
+	__u64 offset;	/* userfb: mmap offset of the snapshot */
+};
+
+/* out: a copy could not be allocated and a later write went through */
+#define VFB2_COW_BROKEN		0x1
+
+struct vfb2_dirty_pages {
+	__u32 count;	/* in: size of the pages array, out: entries used */
+	__u32 reserved;
+	__u64 pages;	/* user pointer to an array of __u32 page numbers */
+};
+
 
 #ifdef __KERNEL__
 
+#include <linux/version.h>
+#include <linux/poll.h>
+
+/* statistics counters, 64 bit atomics exist on all architectures since
+ * 2.6.31 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,31)
+typedef atomic64_t vfb2_counter_t;
+#define vfb2_counter_add(n, c)	atomic64_add((n), (c))
+#define vfb2_counter_read(c)	atomic64_read(c)
+#else
+typedef atomic_long_t vfb2_counter_t;
+#define vfb2_counter_add(n, c)	atomic_long_add((n), (c))
+#define vfb2_counter_read(c)	atomic_long_read(c)
+#endif
+
 struct vfb2_init {
 	__u32 vmem_len;
+	__u32 flags;
 	struct vfb2_mode *mode_table;
 	int (*vfb2_ioctl)(unsigned int cmd, unsigned long arg,
 			  int table_index);
+	/* called for every VFB2_EVENT_*, maybe in atomic context */
+	void (*vfb2_notify)(unsigned int events, int table_index);
 	void *private;
 };
 
@@ -34,6 +215,78 @@ extern int vfb2_current_mode(int table_index);
 extern void *vfb2_videomemory(int table_index);
 extern struct fb_info *vfb2_fb_info(int table_index);
 extern void *vfb2_private(int table_index);
+extern int vfb2_get_damage(int table_index, struct vfb2_damage *damage);
+extern int vfb2_get_dirty_pages(int table_index, __u32 *pages, int count);
+extern int vfb2_get_front(int table_index, struct vfb2_front *front);
+extern unsigned int vfb2_poll(int table_index, struct file *file,
+			      poll_table *wait);
+extern int vfb2_wait_event(int table_index, long timeout);
+extern int vfb2_print_stats(int table_index, char *buf, int size);
+extern int vfb2_get_delta(int table_index, void *buf,
+			  struct vfb2_delta *delta);
+extern int vfb2_get_cursor(int table_index, struct vfb2_cursor *cursor);
+extern int vfb2_get_palette(int table_index, struct vfb2_palette *palette);
+
+/* additional read-only consumers of a frame buffer */
+struct vfb2_client;
+
+extern int vfb2_node_to_index(int node);
+extern struct vfb2_client *vfb2_attach(int table_index,
+				       void (*notify)(unsigned int events,
+						      void *private),
+				       void *private);
+extern void vfb2_detach(struct vfb2_client *client);
+extern int vfb2_client_index(struct vfb2_client *client);
+extern int vfb2_client_get_damage(struct vfb2_client *client,
+				  struct vfb2_damage *damage);
+extern int vfb2_client_get_dirty_pages(struct vfb2_client *client,
+				       __u32 *pages, int count);
+extern unsigned int vfb2_client_poll(struct vfb2_client *client,
+				     struct file *file, poll_table *wait);
+extern int vfb2_client_wait_event(struct vfb2_client *client, long timeout);
+extern int vfb2_client_current_mode(struct vfb2_client *client);
+extern struct fb_info *vfb2_client_fb_info(struct vfb2_client *client);
+extern int vfb2_client_get_front(struct vfb2_client *client,
+				 struct vfb2_front *front);
+extern int vfb2_client_get_cursor(struct vfb2_client *client,
+				  struct vfb2_cursor *cursor);
+extern int vfb2_client_get_palette(struct vfb2_client *client,
+				   struct vfb2_palette *palette);
+extern int vfb2_client_print_stats(struct vfb2_client *client, char *buf,
+				   int size);
+
+/* buf holds size bytes, the lines are copied without gaps, -EAGAIN if the
+ * rectangle did not stay unchanged during any try */
+extern int vfb2_snapshot(int table_index, struct vfb2_snapshot *snap,
+			 void *buf, unsigned long size);
+extern int vfb2_client_snapshot(struct vfb2_client *client,
+				struct vfb2_snapshot *snap, void *buf,
+				unsigned long size);
+
+/* copy-on-write snapshots, see struct vfb2_cow_info */
+struct vfb2_cow;
+
+extern struct vfb2_cow *vfb2_cow_create(int table_index);
+extern struct vfb2_cow *vfb2_client_cow_create(struct vfb2_client *client);
+extern void vfb2_cow_get(struct vfb2_cow *cow);
+extern void vfb2_cow_put(struct vfb2_cow *cow);
+/* may sleep, returns the page locked, it holds the snapshot until
+ * unlock_page */
+extern struct page *vfb2_cow_get_page(struct vfb2_cow *cow,
+				      unsigned long pgoff);
+/* for a vma that maps the snapshot from pgoff on, the pages are zapped
+ * there when a write copies them */
+extern void vfb2_cow_map(struct vfb2_cow *cow, struct address_space *mapping,
+			 unsigned long pgoff);
+extern void vfb2_cow_unmap(struct vfb2_cow *cow);
+extern void vfb2_cow_info(struct vfb2_cow *cow, struct vfb2_cow_info *info);
+
+/* -ENOSPC if the bitmap of tiles->size bytes is too small, the first call
+ * reports all tiles as changed */
+extern int vfb2_get_tiles(int table_index, struct vfb2_tiles *tiles,
+			  __u8 *bitmap);
+extern int vfb2_client_get_tiles(struct vfb2_client *client,
+				 struct vfb2_tiles *tiles, __u8 *bitmap);
 
 #endif /* __KERNEL__ */
 
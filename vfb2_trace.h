@@ -0,0 +1,137 @@
+/****
+ * Tracepoints for vfb2.c
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM vfb2
+
+#if !defined(_VFB2_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _VFB2_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(vfb2_draw,
+	TP_PROTO(int index, u32 dx, u32 dy, u32 width, u32 height),
+	TP_ARGS(index, dx, dy, width, height),
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(u32, dx)
+		__field(u32, dy)
+		__field(u32, width)
+		__field(u32, height)
+	),
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->dx = dx;
+		__entry->dy = dy;
+		__entry->width = width;
+		__entry->height = height;
+	),
+	TP_printk("index=%d %ux%u+%u+%u", __entry->index, __entry->width,
+		  __entry->height, __entry->dx, __entry->dy)
+);
+
+DEFINE_EVENT(vfb2_draw, vfb2_fillrect,
+	TP_PROTO(int index, u32 dx, u32 dy, u32 width, u32 height),
+	TP_ARGS(index, dx, dy, width, height)
+);
+
+DEFINE_EVENT(vfb2_draw, vfb2_copyarea,
+	TP_PROTO(int index, u32 dx, u32 dy, u32 width, u32 height),
+	TP_ARGS(index, dx, dy, width, height)
+);
+
+DEFINE_EVENT(vfb2_draw, vfb2_imageblit,
+	TP_PROTO(int index, u32 dx, u32 dy, u32 width, u32 height),
+	TP_ARGS(index, dx, dy, width, height)
+);
+
+TRACE_EVENT(vfb2_fault,
+	TP_PROTO(int index, unsigned long pgoff, int write),
+	TP_ARGS(index, pgoff, write),
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(unsigned long, pgoff)
+		__field(int, write)
+	),
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->pgoff = pgoff;
+		__entry->write = write;
+	),
+	TP_printk("index=%d pgoff=%lu%s", __entry->index, __entry->pgoff,
+		  __entry->write ? " write" : "")
+);
+
+TRACE_EVENT(vfb2_set_par,
+	TP_PROTO(int index, int mode, u32 xres, u32 yres, u32 bpp),
+	TP_ARGS(index, mode, xres, yres, bpp),
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(int, mode)
+		__field(u32, xres)
+		__field(u32, yres)
+		__field(u32, bpp)
+	),
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->mode = mode;
+		__entry->xres = xres;
+		__entry->yres = yres;
+		__entry->bpp = bpp;
+	),
+	TP_printk("index=%d mode=%d %ux%u-%u", __entry->index, __entry->mode,
+		  __entry->xres, __entry->yres, __entry->bpp)
+);
+
+TRACE_EVENT(vfb2_harvest,
+	TP_PROTO(int index, int rects, int pages, u64 bytes),
+	TP_ARGS(index, rects, pages, bytes),
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(int, rects)
+		__field(int, pages)
+		__field(u64, bytes)
+	),
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->rects = rects;
+		__entry->pages = pages;
+		__entry->bytes = bytes;
+	),
+	TP_printk("index=%d rects=%d pages=%d bytes=%llu", __entry->index,
+		  __entry->rects, __entry->pages,
+		  (unsigned long long)__entry->bytes)
+);
+
+TRACE_EVENT(vfb2_ioctl,
+	TP_PROTO(int index, unsigned int cmd, int ret, s64 ns),
+	TP_ARGS(index, cmd, ret, ns),
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(unsigned int, cmd)
+		__field(int, ret)
+		__field(s64, ns)
+	),
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->cmd = cmd;
+		__entry->ret = ret;
+		__entry->ns = ns;
+	),
+	TP_printk("index=%d cmd=0x%x ret=%d ns=%lld", __entry->index,
+		  __entry->cmd, __entry->ret, (long long)__entry->ns)
+);
+
+#endif /* _VFB2_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE vfb2_trace
+#include <trace/define_trace.h>
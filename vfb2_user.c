@@ -25,6 +25,14 @@
 #include <linux/fb.h>
 #include <linux/init.h>
 #include <linux/proc_fs.h>
+#include <linux/poll.h>
+#include <linux/sched.h>
+#include <linux/ktime.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
 #include <asm/atomic.h>
 #include <asm/uaccess.h>
 
@@ -33,15 +41,151 @@
 
 #define err(format, arg...) printk(KERN_ERR "vfb2_user: " format "\n" , ## arg)
 
+/* larger UVFB2_DELTA buffers are used only up to this size */
+#define UVFB2_MAX_DELTA		(8 * 1024 * 1024)
+/* mmap offset of the UVFB2_COW snapshot in pages, the ring is at 0 */
+#define UVFB2_COW_PGOFF		1UL
+
 static atomic_t uvfb2_number = ATOMIC_INIT(0);
 
 struct uvfb2_device {
 	int vfb2_index;
+	/* set by UVFB2_ATTACH instead of vfb2_index */
+	struct vfb2_client *client;
 	int table_length;
 	struct vfb2_mode *mode_table;
 	int modes;
+	__u32 flags;
+	vfb2_counter_t ioctls;
+	vfb2_counter_t ioctl_ns;
+	/* kept between UVFB2_DELTA calls */
+	void *delta_buf;
+	__u32 delta_size;
+	/* mapped by the client, the records are written by ring_work */
+	struct uvfb2_ring *ring;
+	struct mutex ring_lock;
+	struct work_struct ring_work;
+	wait_queue_head_t ring_wait;
+	__u32 ring_seq;
+	/* the ring was full, events are left pending until poll() finds
+	 * room again */
+	int ring_full;
+	/* the snapshot of UVFB2_COW, mappings hold their own references */
+	struct vfb2_cow *cow;
+	struct mutex cow_lock;
 };
 
+/* the frame buffer this file registered or is attached to, for attached
+ * files only to check that it is still registered */
+static int uvfb2_index(struct uvfb2_device *dev)
+{
+	if (dev->client)
+		return vfb2_client_index(dev->client);
+	return dev->vfb2_index;
+}
+
+static inline int uvfb2_busy(struct uvfb2_device *dev)
+{
+	return (dev->vfb2_index >= 0) || dev->client;
+}
+
+/* attached files reach the device through the client, the index may be
+ * reused after the frame buffer is unregistered */
+static int uvfb2_current_mode(struct uvfb2_device *dev)
+{
+	if (dev->client)
+		return vfb2_client_current_mode(dev->client);
+	return vfb2_current_mode(dev->vfb2_index);
+}
+
+static struct fb_info *uvfb2_fb_info(struct uvfb2_device *dev)
+{
+	if (dev->client)
+		return vfb2_client_fb_info(dev->client);
+	return vfb2_fb_info(dev->vfb2_index);
+}
+
+static int uvfb2_get_front(struct uvfb2_device *dev, struct vfb2_front *front)
+{
+	if (dev->client)
+		return vfb2_client_get_front(dev->client, front);
+	return vfb2_get_front(dev->vfb2_index, front);
+}
+
+static void uvfb2_ring_work(struct work_struct *work)
+{
+	struct uvfb2_device *dev = container_of(work, struct uvfb2_device,
+						ring_work);
+	struct uvfb2_ring *ring;
+	struct uvfb2_ring_entry *entry;
+	struct vfb2_front front;
+	__u32 head;
+	int events;
+
+	mutex_lock(&dev->ring_lock);
+	/* cleared by uvfb2_release */
+	ring = dev->ring;
+	if (!ring)
+		goto exit;
+	head = ring->head;
+	if (head - ACCESS_ONCE(ring->tail) >= UVFB2_RING_ENTRIES) {
+		/* events and damage stay pending and are merged into the
+		 * next record */
+		if (!dev->ring_full)
+			ring->lost++;
+		dev->ring_full = 1;
+		goto exit;
+	}
+	dev->ring_full = 0;
+
+	if (dev->client)
+		events = vfb2_client_wait_event(dev->client, 0);
+	else
+		events = vfb2_wait_event(dev->vfb2_index, 0);
+	if (events <= 0)
+		goto exit;
+
+	dev->ring_seq++;
+
+	entry = &ring->entry[head % UVFB2_RING_ENTRIES];
+	entry->seq = dev->ring_seq;
+	entry->events = events;
+	entry->mode = uvfb2_current_mode(dev);
+	entry->buffer = 0;
+	if (!uvfb2_get_front(dev, &front))
+		entry->buffer = front.index;
+	entry->damage.count = 0;
+	if (dev->client)
+		vfb2_client_get_damage(dev->client, &entry->damage);
+	else
+		vfb2_get_damage(dev->vfb2_index, &entry->damage);
+
+	/* the entry has to be visible before the new head */
+	smp_wmb();
+	ACCESS_ONCE(ring->head) = head + 1;
+	wake_up_interruptible(&dev->ring_wait);
+exit:
+	mutex_unlock(&dev->ring_lock);
+}
+
+/* called by vfb2 within rcu_read_lock, only while the fb is registered */
+static void uvfb2_notify(unsigned int events, int table_index)
+{
+	struct uvfb2_device *dev = vfb2_private(table_index);
+
+	if (dev && ACCESS_ONCE(dev->ring))
+		schedule_work(&dev->ring_work);
+}
+
+/* the same for UVFB2_ATTACH, called with the client lock of vfb2 held */
+static void uvfb2_client_notify(unsigned int events, void *private)
+{
+	struct uvfb2_device *dev = private;
+
+	if (ACCESS_ONCE(dev->ring))
+		schedule_work(&dev->ring_work);
+}
+
 static int uvfb2_open(struct inode *inode, struct file *file)
 {
 	struct uvfb2_device *dev;
@@ -52,6 +196,10 @@ static int uvfb2_open(struct inode *inode, struct file *file)
 
 	memset(dev, 0x00, sizeof(struct uvfb2_device));
 	dev->vfb2_index = -1;
+	mutex_init(&dev->ring_lock);
+	INIT_WORK(&dev->ring_work, uvfb2_ring_work);
+	init_waitqueue_head(&dev->ring_wait);
+	mutex_init(&dev->cow_lock);
 	file->private_data = dev;
 
 	return 0;
@@ -61,14 +209,37 @@ static int uvfb2_release(struct inode *inode, struct file *file)
 {
 	struct uvfb2_device *dev = (struct uvfb2_device *)file->private_data;
 
+	struct uvfb2_ring *ring;
+
 	file->private_data = NULL;
 
+	/* the ring work must not use the frame buffer after it is
+	 * unregistered, its slot in vfb2 may be reused right away */
+	mutex_lock(&dev->ring_lock);
+	ring = dev->ring;
+	dev->ring = NULL;
+	mutex_unlock(&dev->ring_lock);
+	cancel_work_sync(&dev->ring_work);
+
 	if (dev->vfb2_index >= 0) {
+		/* no uvfb2_notify afterwards */
 		vfb2_unregister(dev->vfb2_index);
 		atomic_dec(&uvfb2_number);
 	}
+	if (dev->client)
+		vfb2_detach(dev->client);
+	/* a notify that saw the ring before it was cleared, the work
+	 * returns right away now */
+	cancel_work_sync(&dev->ring_work);
+	if (dev->cow)
+		vfb2_cow_put(dev->cow);
+	/* the file is released only after the last mapping is gone */
+	if (ring)
+		free_page((unsigned long)ring);
 	if (dev->mode_table)
 		kfree(dev->mode_table);
+	if (dev->delta_buf)
+		vfree(dev->delta_buf);
 	kfree(dev);
 
 	return 0;
@@ -77,8 +248,10 @@ static int uvfb2_release(struct inode *inode, struct file *file)
 static ssize_t uvfb2_read(struct file *file, char *buf,
 			  size_t nbytes, loff_t *ppos)
 {
+	struct uvfb2_device *dev = (struct uvfb2_device *)file->private_data;
 	char *page = (char*) __get_free_page(GFP_KERNEL);
 	char *page_pos = page;
+	u64 ioctls;
 	int retval;
 
 	if (!page)
@@ -87,6 +260,24 @@ static ssize_t uvfb2_read(struct file *file, char *buf,
 	page_pos += sprintf(page_pos, "number of user space fb: %i\n",
 			    atomic_read(&uvfb2_number));
 
+	ioctls = vfb2_counter_read(&dev->ioctls);
+	page_pos += sprintf(page_pos, "userfb ioctl: %llu calls, "
+			    "%llu ns average\n", (unsigned long long)ioctls,
+			    ioctls ? (unsigned long long)
+				     vfb2_counter_read(&dev->ioctl_ns) /
+				     ioctls : 0);
+	if (dev->client)
+		retval = vfb2_client_print_stats(dev->client, page_pos,
+					PAGE_SIZE - (page_pos - page));
+	else if (dev->vfb2_index >= 0)
+		retval = vfb2_print_stats(dev->vfb2_index, page_pos,
+					  PAGE_SIZE - (page_pos - page));
+	else
+		retval = 0;
+	if (retval > 0)
+		page_pos += min_t(int, retval,
+				  PAGE_SIZE - 1 - (page_pos - page));
+
 	retval = min(max((int)(page_pos - page - *ppos), 0), (int)nbytes);
 	if (retval == 0)
 		goto error;
@@ -113,18 +304,180 @@ static int uvfb2_mk_table(struct uvfb2_device *dev, int i)
 	return 0;
 }
 
+static int uvfb2_register(struct uvfb2_device *dev, __u32 vmem_len)
+{
+	struct vfb2_init init;
+
+	init.vmem_len = vmem_len;
+	init.flags = dev->flags;
+	init.mode_table = dev->mode_table;
+	init.vfb2_ioctl = NULL;
+	init.vfb2_notify = uvfb2_notify;
+	init.private = dev;
+	dev->vfb2_index = vfb2_register(&init);
+	if (dev->vfb2_index < 0)
+		return dev->vfb2_index;
+	atomic_inc(&uvfb2_number);
+	return 0;
+}
+
+static int uvfb2_create(struct uvfb2_device *dev, void __user *arg)
+{
+	struct uvfb2_create create;
+	struct fb_info *info;
+	__u32 size;
+	int res;
+
+	if (uvfb2_busy(dev))
+		return -EBUSY;
+	if (dev->mode_table)
+		return -EINVAL;
+	if (get_user(size, (__u32 __user *)arg))
+		return -EFAULT;
+	if (size < UVFB2_CREATE_SIZE_V1)
+		return -EINVAL;
+	/* newer fields are zero for older callers */
+	memset(&create, 0x00, sizeof(struct uvfb2_create));
+	if (copy_from_user(&create, arg,
+			   min_t(__u32, size, sizeof(struct uvfb2_create))))
+		return -EFAULT;
+	if ((create.num_modes == 0) || (create.num_modes > UVFB2_MAX_MODES))
+		return -EINVAL;
+
+	res = uvfb2_mk_table(dev, create.num_modes);
+	if (res)
+		return res;
+	if (copy_from_user(dev->mode_table,
+			   (void __user *)(unsigned long)create.modes,
+			   create.num_modes * sizeof(struct vfb2_mode))) {
+		res = -EFAULT;
+		goto error;
+	}
+	/* the table ends with a zero xres */
+	for (dev->modes=0; dev->modes<create.num_modes; dev->modes++)
+		if (!dev->mode_table[dev->modes].xres) {
+			res = -EINVAL;
+			goto error;
+		}
+
+	dev->flags = create.flags;
+	res = uvfb2_register(dev, create.vmem_len);
+	if (res)
+		goto error;
+
+	info = vfb2_fb_info(dev->vfb2_index);
+	create.node = info ? info->node : -1;
+	create.index = dev->vfb2_index;
+	/* the frame buffer stays registered, like after UVFB2_VMEM_SIZE */
+	if (copy_to_user(arg, &create,
+			 min_t(__u32, size, sizeof(struct uvfb2_create))))
+		return -EFAULT;
+	return 0;
+
+error:
+	kfree(dev->mode_table);
+	dev->mode_table = NULL;
+	dev->table_length = 0;
+	dev->modes = 0;
+	return res;
+}
+
+static int uvfb2_delta(struct uvfb2_device *dev, struct vfb2_delta *delta)
+{
+	void __user *ubuf = (void __user *)(unsigned long)delta->buf;
+	int res;
+
+	delta->size = min(delta->size, (__u32)UVFB2_MAX_DELTA);
+	if (delta->size < sizeof(struct vfb2_delta_span))
+		return -EINVAL;
+	if (delta->size > dev->delta_size) {
+		if (dev->delta_buf)
+			vfree(dev->delta_buf);
+		dev->delta_size = 0;
+		dev->delta_buf = vmalloc(delta->size);
+		if (!dev->delta_buf)
+			return -ENOMEM;
+		dev->delta_size = delta->size;
+	}
+
+	res = vfb2_get_delta(dev->vfb2_index, dev->delta_buf, delta);
+	if (res < 0)
+		return res;
+	if (copy_to_user(ubuf, dev->delta_buf, res))
+		return -EFAULT;
+	return 0;
+}
+
+/* takes a new snapshot or drops the old one, reports if the old one broke */
+static int uvfb2_cow(struct uvfb2_device *dev, int index, unsigned long arg)
+{
+	struct vfb2_cow_info info, old_info;
+	struct vfb2_cow *cow = NULL, *old;
+
+	if (index < 0)
+		return -EINVAL;
+	if (copy_from_user(&info, (void *)arg, sizeof(struct vfb2_cow_info)))
+		return -EFAULT;
+	if (info.flags & ~UVFB2_COW_DROP)
+		return -EINVAL;
+	if (!(info.flags & UVFB2_COW_DROP)) {
+		if (dev->client)
+			cow = vfb2_client_cow_create(dev->client);
+		else
+			cow = vfb2_cow_create(index);
+		if (IS_ERR(cow))
+			return PTR_ERR(cow);
+	}
+
+	mutex_lock(&dev->cow_lock);
+	old = dev->cow;
+	dev->cow = cow;
+	mutex_unlock(&dev->cow_lock);
+
+	memset(&info, 0x00, sizeof(struct vfb2_cow_info));
+	if (cow) {
+		vfb2_cow_info(cow, &info);
+		info.offset = UVFB2_COW_PGOFF << PAGE_SHIFT;
+	}
+	if (old) {
+		vfb2_cow_info(old, &old_info);
+		info.flags = old_info.flags;
+		vfb2_cow_put(old);
+	}
+	if (copy_to_user((void *)arg, &info, sizeof(struct vfb2_cow_info)))
+		return -EFAULT;
+	return 0;
+}
+
 /* TODO: is this save on 64bit? */
-static long uvfb2_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+static long __uvfb2_ioctl(struct file *file, unsigned int cmd,
+			  unsigned long arg)
 {
 	struct uvfb2_device *dev = (struct uvfb2_device *)file->private_data;
+	struct vfb2_client *client;
 	int i;
 	int res;
-	struct vfb2_init init;
+	int index = uvfb2_index(dev);
+	__u32 vmem_len;
+	struct vfb2_damage damage;
+	struct vfb2_dirty_pages dirty;
+	struct vfb2_front front;
+	struct vfb2_delta delta;
+	struct vfb2_cursor *cursor;
+	struct vfb2_palette *palette;
+	struct vfb2_tiles tiles;
+	struct vfb2_snapshot snap;
+	unsigned long size;
+	__u8 *bitmap;
+	void *copy;
+	__u32 *pages;
+	__u32 timeout;
+	long timeout_jiffies;
 	struct fb_info *info;
 
 	switch (cmd) {
 	case UVFB2_NUM_MODES:
-		if (dev->vfb2_index >= 0)
+		if (uvfb2_busy(dev))
 			return -EBUSY;
 		if (dev->mode_table)
 			return -EINVAL;
@@ -135,7 +488,7 @@ static long uvfb2_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		return uvfb2_mk_table(dev, i);
 
 	case UVFB2_ADD_MODE:
-		if (dev->vfb2_index >= 0)
+		if (uvfb2_busy(dev))
 			return -EBUSY;
 		if (dev->table_length == 0) {
 			res = uvfb2_mk_table(dev, UVFB2_DEF_NUM_MODES);
@@ -154,25 +507,21 @@ static long uvfb2_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		return 0;
 
 	case UVFB2_VMEM_SIZE:
-		if (dev->vfb2_index >= 0)
+		if (uvfb2_busy(dev))
 			return -EBUSY;
 		if (dev->modes == 0)
 			return -EINVAL;
-		if (get_user(init.vmem_len, (__u32 *)arg))
+		if (get_user(vmem_len, (__u32 *)arg))
 			return -EFAULT;
-		init.mode_table = dev->mode_table;
-		init.vfb2_ioctl = NULL;
-		init.private = NULL;
-		dev->vfb2_index = vfb2_register(&init);
-		if (dev->vfb2_index < 0)
-			return dev->vfb2_index;
-		atomic_inc(&uvfb2_number);
-		return 0;
+		return uvfb2_register(dev, vmem_len);
+
+	case UVFB2_CREATE:
+		return uvfb2_create(dev, (void __user *)arg);
 
 	case UVFB2_MODE:
-		if (dev->vfb2_index < 0)
+		if (index < 0)
 			return -EINVAL;
-		res = vfb2_current_mode(dev->vfb2_index);
+		res = uvfb2_current_mode(dev);
 		if (res < 0)
 			return res;
 		if (put_user(res, (int *)arg))
@@ -180,24 +529,373 @@ static long uvfb2_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		return 0;
 
 	case UVFB2_NODE:
-		if (dev->vfb2_index < 0)
+		if (index < 0)
 			return -EINVAL;
-		info = vfb2_fb_info(dev->vfb2_index);
+		info = uvfb2_fb_info(dev);
 		if (!info)
 			return -EINVAL;
 		if (put_user(info->node, (int *)arg))
 			return -EFAULT;
 		return 0;
+
+	case UVFB2_FLAGS:
+		if (uvfb2_busy(dev))
+			return -EBUSY;
+		if (get_user(dev->flags, (__u32 *)arg))
+			return -EFAULT;
+		return 0;
+
+	case UVFB2_DAMAGE:
+		if (index < 0)
+			return -EINVAL;
+		if (dev->client)
+			res = vfb2_client_get_damage(dev->client, &damage);
+		else
+			res = vfb2_get_damage(index, &damage);
+		if (res < 0)
+			return res;
+		if (copy_to_user((void *)arg, &damage,
+				 sizeof(struct vfb2_damage)))
+			return -EFAULT;
+		return 0;
+
+	case UVFB2_DIRTY_PAGES:
+		if (index < 0)
+			return -EINVAL;
+		if (copy_from_user(&dirty, (void *)arg,
+				   sizeof(struct vfb2_dirty_pages)))
+			return -EFAULT;
+		info = uvfb2_fb_info(dev);
+		if (!info)
+			return -EINVAL;
+		dirty.count = min(dirty.count,
+				  (__u32)(info->fix.smem_len >> PAGE_SHIFT));
+		if (dirty.count == 0)
+			return -EINVAL;
+		pages = kmalloc(dirty.count * sizeof(__u32), GFP_KERNEL);
+		if (!pages)
+			return -ENOMEM;
+		if (dev->client)
+			res = vfb2_client_get_dirty_pages(dev->client, pages,
+							  dirty.count);
+		else
+			res = vfb2_get_dirty_pages(index, pages, dirty.count);
+		if (res >= 0) {
+			dirty.count = res;
+			res = 0;
+			if (copy_to_user((void *)(unsigned long)dirty.pages,
+					 pages, dirty.count * sizeof(__u32)) ||
+			    copy_to_user((void *)arg, &dirty,
+					 sizeof(struct vfb2_dirty_pages)))
+				res = -EFAULT;
+		}
+		kfree(pages);
+		return res;
+
+	case UVFB2_FRONT:
+		if (index < 0)
+			return -EINVAL;
+		res = uvfb2_get_front(dev, &front);
+		if (res < 0)
+			return res;
+		if (copy_to_user((void *)arg, &front, sizeof(struct vfb2_front)))
+			return -EFAULT;
+		return 0;
+
+	case UVFB2_WAIT:
+		if (index < 0)
+			return -EINVAL;
+		if (get_user(timeout, (__u32 *)arg))
+			return -EFAULT;
+		if (timeout == UVFB2_WAIT_FOREVER)
+			timeout_jiffies = MAX_SCHEDULE_TIMEOUT;
+		else
+			timeout_jiffies = msecs_to_jiffies(timeout);
+		if (dev->client)
+			res = vfb2_client_wait_event(dev->client,
+						     timeout_jiffies);
+		else
+			res = vfb2_wait_event(index, timeout_jiffies);
+		if (res < 0)
+			return res;
+		if (put_user(res, (__u32 *)arg))
+			return -EFAULT;
+		return 0;
+
+	case UVFB2_DELTA:
+		if (index < 0)
+			return -EINVAL;
+		/* the shadow copy is the owner's */
+		if (dev->client)
+			return -EPERM;
+		if (copy_from_user(&delta, (void *)arg,
+				   sizeof(struct vfb2_delta)))
+			return -EFAULT;
+		res = uvfb2_delta(dev, &delta);
+		if (res < 0)
+			return res;
+		if (copy_to_user((void *)arg, &delta,
+				 sizeof(struct vfb2_delta)))
+			return -EFAULT;
+		return 0;
+
+	case UVFB2_CURSOR:
+		if (index < 0)
+			return -EINVAL;
+		cursor = kmalloc(sizeof(struct vfb2_cursor), GFP_KERNEL);
+		if (!cursor)
+			return -ENOMEM;
+		if (dev->client)
+			res = vfb2_client_get_cursor(dev->client, cursor);
+		else
+			res = vfb2_get_cursor(index, cursor);
+		if (!res && copy_to_user((void *)arg, cursor,
+					 sizeof(struct vfb2_cursor)))
+			res = -EFAULT;
+		kfree(cursor);
+		return res;
+
+	case UVFB2_PALETTE:
+		if (index < 0)
+			return -EINVAL;
+		palette = kmalloc(sizeof(struct vfb2_palette), GFP_KERNEL);
+		if (!palette)
+			return -ENOMEM;
+		if (dev->client)
+			res = vfb2_client_get_palette(dev->client, palette);
+		else
+			res = vfb2_get_palette(index, palette);
+		if (!res && copy_to_user((void *)arg, palette,
+					 sizeof(struct vfb2_palette)))
+			res = -EFAULT;
+		kfree(palette);
+		return res;
+
+	case UVFB2_TILES:
+		if (index < 0)
+			return -EINVAL;
+		if (copy_from_user(&tiles, (void *)arg,
+				   sizeof(struct vfb2_tiles)))
+			return -EFAULT;
+		if (!tiles.size || (tiles.size > UVFB2_MAX_TILE_BITMAP))
+			return -EINVAL;
+		bitmap = kmalloc(tiles.size, GFP_KERNEL);
+		if (!bitmap)
+			return -ENOMEM;
+		if (dev->client)
+			res = vfb2_client_get_tiles(dev->client, &tiles,
+						    bitmap);
+		else
+			res = vfb2_get_tiles(index, &tiles, bitmap);
+		if (!res && copy_to_user((void *)(unsigned long)tiles.bitmap,
+					 bitmap, tiles.size))
+			res = -EFAULT;
+		kfree(bitmap);
+		/* the size needed is returned with -ENOSPC */
+		if ((!res || (res == -ENOSPC)) &&
+		    copy_to_user((void *)arg, &tiles,
+				 sizeof(struct vfb2_tiles)))
+			res = -EFAULT;
+		return res;
+
+	case UVFB2_SNAPSHOT:
+		if (index < 0)
+			return -EINVAL;
+		if (copy_from_user(&snap, (void *)arg,
+				   sizeof(struct vfb2_snapshot)))
+			return -EFAULT;
+		info = uvfb2_fb_info(dev);
+		if (!info)
+			return -EINVAL;
+		/* vfb2_snapshot checks the rectangle against this size */
+		size = (unsigned long)snap.rect.width * snap.rect.height *
+		       DIV_ROUND_UP(info->var.bits_per_pixel, 8);
+		if (!size || (size > info->fix.smem_len))
+			return -EINVAL;
+		/* the copy into kernel memory can not fault, so the window
+		 * for writers is short */
+		copy = vmalloc(size);
+		if (!copy)
+			return -ENOMEM;
+		if (dev->client)
+			res = vfb2_client_snapshot(dev->client, &snap, copy,
+						   size);
+		else
+			res = vfb2_snapshot(index, &snap, copy, size);
+		if (!res && (snap.pitch < snap.bytes))
+			res = -EINVAL;
+		for (i=0; !res && (i<snap.rect.height); i++)
+			if (copy_to_user((void *)(unsigned long)snap.buf +
+					 (unsigned long)i * snap.pitch,
+					 copy + (unsigned long)i * snap.bytes,
+					 snap.bytes))
+				res = -EFAULT;
+		vfree(copy);
+		if ((!res || (res == -EAGAIN)) &&
+		    copy_to_user((void *)arg, &snap,
+				 sizeof(struct vfb2_snapshot)))
+			res = -EFAULT;
+		return res;
+
+	case UVFB2_COW:
+		return uvfb2_cow(dev, index, arg);
+
+	case UVFB2_ATTACH:
+		if (uvfb2_busy(dev))
+			return -EBUSY;
+		if (get_user(i, (int *)arg))
+			return -EFAULT;
+		res = vfb2_node_to_index(i);
+		if (res < 0)
+			return res;
+		client = vfb2_attach(res, uvfb2_client_notify, dev);
+		if (IS_ERR(client))
+			return PTR_ERR(client);
+		dev->client = client;
+		return 0;
 	}
 
 	return -ENOIOCTLCMD;
 }
 
+static long uvfb2_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct uvfb2_device *dev = (struct uvfb2_device *)file->private_data;
+	ktime_t start = ktime_get();
+	long ret;
+
+	ret = __uvfb2_ioctl(file, cmd, arg);
+	vfb2_counter_add(1, &dev->ioctls);
+	vfb2_counter_add(ktime_to_ns(ktime_sub(ktime_get(), start)),
+		     &dev->ioctl_ns);
+	return ret;
+}
+
+static unsigned int uvfb2_poll(struct file *file, poll_table *wait)
+{
+	struct uvfb2_device *dev = (struct uvfb2_device *)file->private_data;
+	struct uvfb2_ring *ring = ACCESS_ONCE(dev->ring);
+
+	if (dev->client && !ring)
+		return vfb2_client_poll(dev->client, file, wait);
+	if (!uvfb2_busy(dev))
+		return POLLERR;
+	if (!ring)
+		return vfb2_poll(dev->vfb2_index, file, wait);
+
+	poll_wait(file, &dev->ring_wait, wait);
+	/* the client made room for the events left pending */
+	if (ACCESS_ONCE(dev->ring_full) &&
+	    (ACCESS_ONCE(ring->head) - ACCESS_ONCE(ring->tail) <
+	     UVFB2_RING_ENTRIES))
+		schedule_work(&dev->ring_work);
+	if (ACCESS_ONCE(ring->head) != ACCESS_ONCE(ring->tail))
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static void uvfb2_cow_vm_open(struct vm_area_struct *vma)
+{
+	vfb2_cow_get(vma->vm_private_data);
+	vfb2_cow_map(vma->vm_private_data, vma->vm_file->f_mapping,
+		     UVFB2_COW_PGOFF);
+}
+
+static void uvfb2_cow_vm_close(struct vm_area_struct *vma)
+{
+	vfb2_cow_unmap(vma->vm_private_data);
+	vfb2_cow_put(vma->vm_private_data);
+}
+
+static int uvfb2_cow_vm_fault(struct vm_area_struct *vma,
+			      struct vm_fault *vmf)
+{
+	struct page *page;
+
+	page = vfb2_cow_get_page(vma->vm_private_data,
+				 vmf->pgoff - UVFB2_COW_PGOFF);
+	/* a lazy page that was never written */
+	if (!page) {
+		page = ZERO_PAGE(0);
+		get_page(page);
+		vmf->page = page;
+		return 0;
+	}
+	/* the page lock holds off the write until the pte is in place */
+	vmf->page = page;
+	return VM_FAULT_LOCKED;
+}
+
+static struct vm_operations_struct uvfb2_cow_vm_ops = {
+	.open	= uvfb2_cow_vm_open,
+	.close	= uvfb2_cow_vm_close,
+	.fault	= uvfb2_cow_vm_fault,
+};
+
+/* read-only, the mapping keeps the snapshot after the next UVFB2_COW */
+static int uvfb2_mmap_cow(struct uvfb2_device *dev,
+			  struct vm_area_struct *vma)
+{
+	struct vfb2_cow_info info;
+	int ret = -EINVAL;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EACCES;
+
+	mutex_lock(&dev->cow_lock);
+	if (!dev->cow)
+		goto exit;
+	vfb2_cow_info(dev->cow, &info);
+	if (vma->vm_end - vma->vm_start > info.size)
+		goto exit;
+	vma->vm_private_data = dev->cow;
+	uvfb2_cow_vm_open(vma);
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND;
+	vma->vm_ops = &uvfb2_cow_vm_ops;
+	ret = 0;
+exit:
+	mutex_unlock(&dev->cow_lock);
+	return ret;
+}
+
+static int uvfb2_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct uvfb2_device *dev = (struct uvfb2_device *)file->private_data;
+	unsigned long page;
+	int ret = -EINVAL;
+
+	if (vma->vm_pgoff == UVFB2_COW_PGOFF)
+		return uvfb2_mmap_cow(dev, vma);
+	if (vma->vm_pgoff || (vma->vm_end - vma->vm_start != PAGE_SIZE))
+		return -EINVAL;
+
+	mutex_lock(&dev->ring_lock);
+	if (!dev->ring) {
+		ret = -ENOMEM;
+		page = get_zeroed_page(GFP_KERNEL);
+		if (!page)
+			goto exit;
+		dev->ring = (struct uvfb2_ring *)page;
+	}
+	vma->vm_flags |= VM_DONTEXPAND;
+	ret = vm_insert_page(vma, vma->vm_start, virt_to_page(dev->ring));
+exit:
+	mutex_unlock(&dev->ring_lock);
+
+	/* events that happened before the ring existed */
+	if (!ret && uvfb2_busy(dev))
+		schedule_work(&dev->ring_work);
+	return ret;
+}
+
 struct file_operations uvfb2_fops = {
 	.owner = THIS_MODULE,
 	.open = uvfb2_open,
 	.release = uvfb2_release,
 	.read = uvfb2_read,
+	.poll = uvfb2_poll,
+	.mmap = uvfb2_mmap,
 	.unlocked_ioctl = uvfb2_ioctl,
 	.compat_ioctl = uvfb2_ioctl,
 //	.ioctl = uvfb2_ioctl,
@@ -207,15 +905,23 @@ static int __init uvfb2_init(void)
 {
 	struct proc_dir_entry *pentry;
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+	/* create_proc_entry is gone since 3.10 */
+	pentry = proc_create(UVFB2_DEVICE,
+			     S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP, NULL,
+			     &uvfb2_fops);
+#else
 	pentry = create_proc_entry(UVFB2_DEVICE,
 				   S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP,
 				   NULL);
+	if (pentry)
+		pentry->proc_fops = &uvfb2_fops;
+#endif
 	if (!pentry) {
 		err("can not create /proc/" UVFB2_DEVICE);
 		return -EPERM;
 	}
 //	pentry->owner = THIS_MODULE;
-	pentry->proc_fops = &uvfb2_fops;
 	return 0;
 }
 
@@ -18,6 +18,7 @@
 
 /* set size of the videomemory and register the frame buffer
  * after this ioctl was called, you can not add modes any more
+ * with VFB2_FLAG_RESIZE_VMEM this is the maximum size
  */
 #define UVFB2_VMEM_SIZE		_IOW('F', UVFB2_IOCTL_BASE+2, __u32)
 
@@ -27,6 +28,124 @@
 /* returns the node number of the fb device */
 #define UVFB2_NODE		_IOR('F', UVFB2_IOCTL_BASE+4, int)
 
+/* set feature flags (VFB2_FLAG_*), call this before UVFB2_VMEM_SIZE */
+#define UVFB2_FLAGS		_IOW('F', UVFB2_IOCTL_BASE+5, __u32)
+
+/* returns the damaged rectangles since the last call and clears them,
+ * needs VFB2_FLAG_DAMAGE */
+#define UVFB2_DAMAGE		_IOR('F', UVFB2_IOCTL_BASE+6, struct vfb2_damage)
+
+/* returns the numbers of the pages written through mmap since the last call
+ * and write protects them again, needs VFB2_FLAG_DEFIO. If more pages are
+ * dirty than fit into the array, the rest is returned by the next call */
+#define UVFB2_DIRTY_PAGES	_IOWR('F', UVFB2_IOCTL_BASE+7, \
+				      struct vfb2_dirty_pages)
+
+/* waits until an event occurs, in: timeout in ms (0 does not block,
+ * UVFB2_WAIT_FOREVER does not time out), out: VFB2_EVENT_* mask or 0 on
+ * timeout. The returned events are cleared. poll() signals POLLIN while
+ * events are pending. */
+#define UVFB2_WAIT		_IOWR('F', UVFB2_IOCTL_BASE+8, __u32)
+#define UVFB2_WAIT_FOREVER	0xffffffff
+
+/* returns the front buffer, needs VFB2_FLAG_BUFFERING to be useful */
+#define UVFB2_FRONT		_IOR('F', UVFB2_IOCTL_BASE+9, struct vfb2_front)
+
+/* returns the changes since the last call as struct vfb2_delta_span
+ * records, needs VFB2_FLAG_SHADOW. Damaged rectangles and, with
+ * VFB2_FLAG_DEFIO, dirty pages are compared against the shadow copy. */
+#define UVFB2_DELTA		_IOWR('F', UVFB2_IOCTL_BASE+10, \
+				      struct vfb2_delta)
+
+/* UVFB2_IOCTL_BASE+11 is kept for a dma-buf export */
+
+/* returns the cursor, needs VFB2_FLAG_CURSOR */
+#define UVFB2_CURSOR		_IOR('F', UVFB2_IOCTL_BASE+13, \
+				     struct vfb2_cursor)
+
+/* Attaches to the frame buffer with the given node, registered by another
+ * userfb file or a kernel driver. The file then gets damage, dirty pages
+ * and events of its own, so several consumers each see what changed since
+ * they last asked. UVFB2_MODE, UVFB2_NODE, UVFB2_FRONT, UVFB2_CURSOR,
+ * UVFB2_WAIT and the ring work as for the owner, UVFB2_DELTA is left to
+ * the owner. Only for a file that has not registered a frame buffer
+ * itself. */
+#define UVFB2_ATTACH		_IOW('F', UVFB2_IOCTL_BASE+14, int)
+
+/* returns the tiles whose contents changed since the last call, see
+ * struct vfb2_tiles, works without write faults. Attached files get their
+ * own hashes. */
+#define UVFB2_TILES		_IOWR('F', UVFB2_IOCTL_BASE+15, \
+				      struct vfb2_tiles)
+/* larger bitmaps are refused */
+#define UVFB2_MAX_TILE_BITMAP	(64 * 1024)
+
+/* copies a rectangle that no writer touched meanwhile, see struct
+ * vfb2_snapshot, -EAGAIN if every try was disturbed */
+#define UVFB2_SNAPSHOT		_IOWR('F', UVFB2_IOCTL_BASE+16, \
+				      struct vfb2_snapshot)
+
+/* Freezes the current frame, see struct vfb2_cow_info. The snapshot is
+ * mapped read-only with mmap at the returned offset, a mapping keeps its
+ * snapshot until it is unmapped. The next call replaces the snapshot of the
+ * file and returns VFB2_COW_BROKEN if the one it replaced broke. With
+ * UVFB2_COW_DROP set in flags no new snapshot is taken. */
+#define UVFB2_COW		_IOWR('F', UVFB2_IOCTL_BASE+17, \
+				      struct vfb2_cow_info)
+#define UVFB2_COW_DROP		0x100
+
+/* returns the palette of 8bpp modes, see VFB2_EVENT_PALETTE */
+#define UVFB2_PALETTE		_IOR('F', UVFB2_IOCTL_BASE+18, \
+				     struct vfb2_palette)
+
+/* sets up and registers the frame buffer in one call, instead of
+ * UVFB2_FLAGS, UVFB2_NUM_MODES, UVFB2_ADD_MODE, UVFB2_VMEM_SIZE and
+ * UVFB2_NODE */
+struct uvfb2_create {
+	__u32 size;		/* sizeof(struct uvfb2_create) */
+	__u32 flags;		/* VFB2_FLAG_* */
+	__u32 vmem_len;
+	__u32 num_modes;
+	__u64 modes;		/* user pointer to num_modes struct vfb2_mode */
+	__s32 node;		/* out: node number of the fb device */
+	__s32 index;		/* out: vfb2 table index */
+};
+
+/* the first version, later versions only append fields */
+#define UVFB2_CREATE_SIZE_V1	32
+#define UVFB2_MAX_MODES		1024
+
+#define UVFB2_CREATE		_IOWR('F', UVFB2_IOCTL_BASE+12, \
+				      struct uvfb2_create)
+
+/* Mapping one page of the userfb file at offset 0 gives a ring of event
+ * records, from then on events and damage are delivered there instead of
+ * UVFB2_WAIT and UVFB2_DAMAGE. The kernel writes an entry and then
+ * increments head, the client reads entries up to head and then sets tail
+ * to the next entry it wants to read. If the ring is full, events and
+ * damage stay pending and lost is incremented, they are merged into the
+ * next record once poll() finds room again. poll() signals POLLIN while
+ * head != tail. */
+#define UVFB2_RING_ENTRIES	16
+
+struct uvfb2_ring_entry {
+	__u32 seq;		/* counts all records */
+	__u32 events;		/* VFB2_EVENT_* */
+	__u32 mode;		/* current mode */
+	__u32 buffer;		/* current front buffer index */
+	struct vfb2_damage damage;
+};
+
+struct uvfb2_ring {
+	__u32 head;		/* written by the kernel */
+	__u32 reserved0[15];
+	__u32 tail;		/* written by the client */
+	__u32 reserved1[15];
+	__u32 lost;		/* written by the kernel */
+	__u32 reserved2[15];
+	struct uvfb2_ring_entry entry[UVFB2_RING_ENTRIES];
+};
+
 /* to unregister the frame buffer, just close the file */
 
 #endif /* _LINUX_VFB2_USER_H */